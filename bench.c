@@ -0,0 +1,440 @@
+// benchmarks for the hot paths of pixelcli
+//
+// builds pixelcli.c with its main renamed, runs every benchmark on
+// synthetic canvases and prints one json object per line:
+//
+//   {"bench": "save_image", "size": 256, "iterations": 12, ...}
+//
+// seconds, bytes_written and allocations are per iteration, 
+// bytes_written is what went to the terminal for the render
+// benchmarks and the file size for the save benchmarks
+//
+// usage: bench [max_size]
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+// count the allocations of pixelcli (libpng and zlib aren't counted)
+static size_t bench_allocs = 0;
+
+static void *bench_malloc(size_t n) {
+  __atomic_fetch_add(&bench_allocs, 1, __ATOMIC_RELAXED);
+  return malloc(n);
+}
+
+static void *bench_calloc(size_t n, size_t size) {
+  __atomic_fetch_add(&bench_allocs, 1, __ATOMIC_RELAXED);
+  return calloc(n, size);
+}
+
+static void *bench_realloc(void *p, size_t n) {
+  __atomic_fetch_add(&bench_allocs, 1, __ATOMIC_RELAXED);
+  return realloc(p, n);
+}
+
+#define malloc(n) bench_malloc(n)
+#define calloc(n, size) bench_calloc(n, size)
+#define realloc(p, n) bench_realloc(p, n)
+#define main pixelcli_main
+#include "pixelcli.c"
+#undef main
+#undef malloc
+#undef calloc
+#undef realloc
+
+#define BENCH_MIN_SECONDS 0.2 // repeat fast benchmarks at least this long
+#define BENCH_MAX_ITERATIONS 10000
+#define BENCH_TERM_ROWS 50
+#define BENCH_TERM_COLS 100
+#define BENCH_PNG_PATH "/tmp/pixelcli_bench.png"
+#define BENCH_SNAPSHOT_PATH "/tmp/pixelcli_bench.pcli_failsave"
+#define BENCH_KERNEL_SIZE 4096 // canvas size of the kernel comparison
+
+int bench_size = 0;
+
+static double now() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/// draws a synthetic image into the global image:
+/// blocks of palette colors with a gradient and some noise,
+/// so it neither compresses to nothing nor is pure noise
+static void draw_synthetic(int size) {
+  alloc_canvas(size, size);
+  unsigned int seed = 1;
+  for (int row = 0; row < size; row++) {
+    for (int col = 0; col < size; col++) {
+      int block = ((row / 8) + (col / 8)) % 4;
+      int r = color_palette[block][0];
+      int g = (color_palette[block][1] + row) & 0xff;
+      int b = (color_palette[block][2] + col) & 0xff;
+      seed = seed * 1103515245 + 12345;
+      if ((seed >> 16) % 16 == 0) {
+        r = (seed >> 8) & 0xff;
+      }
+      set_pixel(r, g, b, 255, row, col);
+    }
+  }
+}
+
+/// draws the blocks of palette colors of draw_synthetic without the
+/// gradient and the noise and converts the image to indexed pixels
+static void draw_indexed(int size) {
+  alloc_canvas(size, size);
+  for (int row = 0; row < size; row++) {
+    for (int col = 0; col < size; col++) {
+      int block = ((row / 8) + (col / 8)) % 4;
+      set_pixel(color_palette[block][0], color_palette[block][1], 
+          color_palette[block][2], 255, row, col);
+    }
+  }
+  if (convert_canvas(&image, 1) == ERROR) {
+    die("convert_canvas");
+  }
+}
+
+static void report(const char *name, int iterations, double seconds,
+    size_t pixels, size_t bytes, size_t allocs)
+{
+  printf("{\"bench\": \"%s\", \"size\": %d, \"iterations\": %d, "
+      "\"seconds\": %.6f, \"pixels_per_second\": %.0f, "
+      "\"bytes_written\": %zu, \"allocations\": %zu}\n",
+      name, bench_size, iterations, seconds / iterations,
+      pixels * (double)iterations / seconds,
+      bytes / iterations, allocs / iterations);
+  fflush(stdout);
+}
+
+static size_t file_size(const char *path) {
+  struct stat st;
+  return stat(path, &st) == 0 ? (size_t)st.st_size : 0;
+}
+
+// every benchmark does one iteration and returns the bytes it wrote
+
+static size_t bench_init_image() {
+  init_image(bench_size, bench_size);
+  return 0;
+}
+
+static size_t bench_load_image() {
+  free_canvas(&image);
+  if (load_image(BENCH_PNG_PATH) == ERROR) {
+    die("load_image");
+  }
+  return 0;
+}
+
+static size_t bench_load_snapshot() {
+  free_canvas(&image);
+  if (load_image(BENCH_SNAPSHOT_PATH) == ERROR) {
+    die("load_failsave");
+  }
+  return 0;
+}
+
+static size_t bench_print_screen() {
+  size_t before = frame_bytes_written;
+  print_screen();
+  return frame_bytes_written - before;
+}
+
+static size_t bench_scroll() {
+  size_t before = frame_bytes_written;
+  y_offset = (y_offset + 1) % MAX((int)image.height - term.rows, 1);
+  render_frame();
+  return frame_bytes_written - before;
+}
+
+static size_t bench_fill_selection() {
+  static int color = 0;
+  color = (color + 1) % 10;
+  fill_selection(0, 0, image.height - 1, image.width - 1,
+      color_palette[color][0],
+      color_palette[color][1],
+      color_palette[color][2], 255);
+  return 0;
+}
+
+static size_t bench_paste() {
+  // the clipboard holds the whole image, it is pasted one pixel off
+  // so every pixel changes
+  static int offset = 0;
+  offset = !offset;
+  paste(offset, offset);
+  return 0;
+}
+
+static size_t bench_jmp_next_color() {
+  x_cursor = 0;
+  y_cursor = 0;
+  while (x_cursor < MIN(term.cols, (int)image.width) - 1) {
+    jmp_next_color(y_cursor, x_cursor, 1);
+  }
+  return 0;
+}
+
+static size_t bench_read_rows() {
+  static unsigned char *row = NULL;
+  row = realloc(row, (size_t)image.width * IMAGE_DEPTH);
+  for (int r = 0; r < image.height; r++) {
+    read_canvas_row(&image, r, row);
+  }
+  return 0;
+}
+
+static size_t bench_save_image() {
+  if (save_image(&image, BENCH_PNG_PATH, &png_settings) != SUCCESS) {
+    die("save_image");
+  }
+  return file_size(BENCH_PNG_PATH);
+}
+
+static size_t bench_save_image_parallel() {
+  struct png_settings settings = png_settings;
+  settings.threads = 0;
+  if (save_image(&image, BENCH_PNG_PATH, &settings) != SUCCESS) {
+    die("save_image");
+  }
+  return file_size(BENCH_PNG_PATH);
+}
+
+static size_t bench_save_snapshot() {
+  if (save_snapshot(&image, BENCH_SNAPSHOT_PATH) != SUCCESS) {
+    die("save_snapshot");
+  }
+  return file_size(BENCH_SNAPSHOT_PATH);
+}
+
+static size_t bench_key_alpha() {
+  static unsigned char *row = NULL;
+  row = realloc(row, (size_t)image.width * IMAGE_DEPTH);
+  for (int r = 0; r < image.height; r++) {
+    read_canvas_row(&image, r, row);
+    normalize_row(row, image.width);
+  }
+  return 0;
+}
+
+static size_t bench_blend_over() {
+  // half transparent pixels of every color over the opaque image
+  static unsigned char *src = NULL;
+  static unsigned char *row = NULL;
+  size_t bytes = (size_t)image.width * IMAGE_DEPTH;
+  if (!src) {
+    src = malloc(bytes);
+    for (size_t i = 0; i < bytes; i++) {
+      src[i] = i % IMAGE_DEPTH == ALPHA_OFFSET ? 128 : i * 7;
+    }
+  }
+  row = realloc(row, bytes);
+  for (int r = 0; r < image.height; r++) {
+    read_canvas_row(&image, r, row);
+    kernels->blend_over(row, src, image.width, 200);
+  }
+  return 0;
+}
+
+static size_t bench_color_run() {
+  // the whole image is one color so every row is searched to the end
+  size_t same = 0;
+  for (int r = 0; r < image.height; r++) {
+    same += row_color_run(r, 0, image.width, 1, get_pixel(&image, r, 0));
+    same += row_color_run(r, image.width - 1, image.width, -1, 
+        get_pixel(&image, r, 0));
+  }
+  if (same != (size_t)2 * image.width * image.height) {
+    die("row_color_run");
+  }
+  return 0;
+}
+
+static size_t bench_recolor() {
+  // swaps the color of a block everywhere and redraws once
+  static int color = 0;
+  size_t before = frame_bytes_written;
+  color = (color + 1) % 10;
+  recolor_entry(0, 0, color_palette[color][0], color_palette[color][1], 
+      color_palette[color][2], 255);
+  render_frame();
+  return frame_bytes_written - before;
+}
+
+/// opens the saved png as a second buffer next to the image
+static void open_buffers() {
+  bufferc = 2;
+  buffers = calloc(bufferc, sizeof(*buffers));
+  if (!buffers) {
+    die("calloc");
+  }
+  strcpy(buffers[1].path, BENCH_PNG_PATH);
+  buffers[1].state = BUFFER_UNLOADED;
+  if (switch_buffer(1) == ERROR) {
+    die("switch_buffer");
+  }
+}
+
+/// goes back to the first buffer and drops the second one
+static void close_buffers() {
+  switch_buffer(0);
+  remove_spilled_buffers();
+  free_canvas(&buffers[1].image);
+  free(buffers[1].packed[0].data);
+  free(buffers);
+  buffers = NULL;
+  bufferc = 0;
+  current_buffer = 0;
+}
+
+static size_t bench_switch_buffer() {
+  if (switch_buffer(!current_buffer) == ERROR) {
+    die("switch_buffer");
+  }
+  return 0;
+}
+
+static size_t bench_render_unchanged() {
+  size_t before = frame_bytes_written;
+  render_frame();
+  return frame_bytes_written - before;
+}
+
+/// runs a benchmark until it took BENCH_MIN_SECONDS
+static void run(const char *name, size_t (*fn)(), size_t pixels) {
+  size_t bytes = 0;
+  size_t allocs = bench_allocs;
+  int iterations = 0;
+  double start = now();
+  double elapsed = 0;
+  do {
+    bytes += fn();
+    iterations++;
+    elapsed = now() - start;
+  } while (elapsed < BENCH_MIN_SECONDS && iterations < BENCH_MAX_ITERATIONS);
+  report(name, iterations, elapsed, pixels, bytes, bench_allocs - allocs);
+}
+
+/// runs the benchmarks of the kernels with every kernel set
+/// the cpu supports, the names get the set as suffix
+static void bench_kernels() {
+  const struct kernels *sets[] = { &scalar_kernels,
+#ifdef X86_KERNELS
+    &sse2_kernels, &avx2_kernels,
+#endif
+  };
+  const struct kernels *best = kernels;
+  bench_size = BENCH_KERNEL_SIZE;
+  size_t pixels = (size_t)bench_size * bench_size;
+  size_t cells = (size_t)term.rows * term.cols;
+
+  for (int i = 0; i < sizeof(sets) / sizeof(sets[0]); i++) {
+#ifdef X86_KERNELS
+    if (sets[i] == &avx2_kernels && !__builtin_cpu_supports("avx2")) {
+      continue;
+    }
+#endif
+    kernels = sets[i];
+    char name[64];
+
+    draw_synthetic(bench_size);
+    snprintf(name, sizeof(name), "key_alpha/%s", kernels->name);
+    run(name, bench_key_alpha, pixels);
+    snprintf(name, sizeof(name), "blend_over/%s", kernels->name);
+    run(name, bench_blend_over, pixels);
+    snprintf(name, sizeof(name), "print_screen/%s", kernels->name);
+    run(name, bench_print_screen, cells);
+    snprintf(name, sizeof(name), "render_unchanged/%s", kernels->name);
+    run(name, bench_render_unchanged, cells);
+    snprintf(name, sizeof(name), "fill_selection/%s", kernels->name);
+    run(name, bench_fill_selection, pixels);
+    snprintf(name, sizeof(name), "color_run/%s", kernels->name);
+    run(name, bench_color_run, 2 * pixels);
+  }
+  kernels = best;
+}
+
+int main(int argc, char *argv[]) {
+  int max_size = argc > 1 ? atoi(argv[1]) : 8192;
+
+  init_kernels();
+
+  frame_fd = open("/dev/null", O_WRONLY);
+  if (frame_fd == -1) {
+    die("open");
+  }
+  term.lines = BENCH_TERM_ROWS;
+  term.width = 2 * BENCH_TERM_COLS;
+  update_view_size();
+
+  for (bench_size = 16; bench_size <= max_size; bench_size *= 4) {
+    size_t pixels = (size_t)bench_size * bench_size;
+    size_t visible = (size_t)MIN(bench_size, term.rows)
+      * MIN(bench_size, term.cols);
+
+    run("init_image", bench_init_image, pixels);
+    draw_synthetic(bench_size);
+    run("print_screen", bench_print_screen, visible);
+    short_escapes = 1;
+    run("print_screen_short_escapes", bench_print_screen, visible);
+    short_escapes = 0;
+    run("scroll", bench_scroll, visible);
+    // the first iteration builds the mip levels
+    zoom = -3;
+    run("print_screen_zoomed", bench_print_screen, visible);
+    zoom = 0;
+    half_block = 1;
+    update_view_size();
+    run("print_screen_half_block", bench_print_screen, 
+        (size_t)MIN(bench_size, term.rows) * MIN(bench_size, term.cols));
+    half_block = 0;
+    update_view_size();
+    run("fill_selection", bench_fill_selection, pixels);
+    draw_synthetic(bench_size);
+    yank(0, 0, bench_size - 1, bench_size - 1);
+    paste_skip_transparent = 0;
+    run("paste", bench_paste, pixels);
+    paste_skip_transparent = 1;
+    run("paste_skip_transparent", bench_paste, pixels);
+    draw_synthetic(bench_size);
+    run("jmp_next_color", bench_jmp_next_color, MIN(bench_size, term.cols));
+    run("read_rows", bench_read_rows, pixels);
+    run("save_image", bench_save_image, pixels);
+    run("save_image_parallel", bench_save_image_parallel, pixels);
+    run("load_image", bench_load_image, pixels);
+    snapshot_compression = 0;
+    run("save_snapshot", bench_save_snapshot, pixels);
+    run("load_snapshot", bench_load_snapshot, pixels);
+    snapshot_compression = 1;
+    run("save_snapshot_compressed", bench_save_snapshot, pixels);
+    run("load_snapshot_compressed", bench_load_snapshot, pixels);
+    // both buffers resident, then the hidden one packed, then spilled
+    // (the default budget doesn't fit two of the biggest images)
+    size_t budget = buffer_budget;
+    buffer_budget = SIZE_MAX;
+    open_buffers();
+    run("switch_buffer", bench_switch_buffer, pixels);
+    buffer_budget = canvas_bytes(&image) * 3 / 2;
+    run("switch_buffer_packed", bench_switch_buffer, pixels);
+    buffer_budget = 0;
+    run("switch_buffer_spilled", bench_switch_buffer, pixels);
+    buffer_budget = budget;
+    close_buffers();
+    draw_indexed(bench_size);
+    run("recolor_indexed", bench_recolor, pixels);
+    run("save_image_indexed", bench_save_image, pixels);
+
+    // 8192 isn't a power of 4 from 16
+    if (bench_size < max_size && bench_size * 4 > max_size) {
+      bench_size = max_size / 4;
+    }
+  }
+
+  bench_kernels();
+
+  unlink(BENCH_PNG_PATH);
+  unlink(BENCH_SNAPSHOT_PATH);
+  return SUCCESS;
+}
@@ -12,50 +12,483 @@
 #include <png.h>
 #include <pngconf.h>
 #include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <signal.h>
+
+// the vectorized kernels are only built for x86 (see init_kernels)
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define X86_KERNELS
+#include <immintrin.h>
+#endif
 
 /*** defines ***/
 
-#define BLOCK '█'
-#define COLOR_INX_OFFSET 7
-#define RED_OFFSET 7
-#define GREEN_OFFSET 11
-#define BLUE_OFFSET 15
+#define UPPER_HALF_BLOCK "▀"
+#define LOWER_HALF_BLOCK "▄"
+#define RED_OFFSET 0
+#define GREEN_OFFSET 1
+#define BLUE_OFFSET 2
+#define ALPHA_OFFSET 3
 #define BYTES_PER_CHAR 20
 #define ERROR -1
 #define SUCCESS 0
-#define SIZEOF_POINTER 8
 #define IMAGE_DEPTH 4
 #define ASCII_NUMBERS_START 48
 #define CONFIG_PATH_AMOUNT 4
-#define COMMANDC 30
+#define BINDING_MAX 16 // keys of a binding + 1
+#define KEY_TABLE_SIZE 256
+#define FRAME_GAP_MAX 2
+#define SNAPSHOT_MAGIC "PCLI"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_COMPRESSED 1 // flag for deflated blocks
+#define SNAPSHOT_BLOCK_ROWS 64
+#define FAILSAVE_PATH "saved_image.pcli_failsave"
+#define PNG_FILTER_DEFAULT_MASK -1 // let libpng decide
+#define PNG_ROW_FILTERS 5 // none, sub, up, avg, paeth
+#define SAVED_PNG 0
+#define SAVED_FAILSAVE 1
+#define STATUS_MAX 128
+#define TILE_SHIFT 6 // the canvas is stored in tiles of 64x64 pixels
+#define TILE_SIZE (1 << TILE_SHIFT)
+#define TILE_PIXELS (TILE_SIZE * TILE_SIZE)
+#define TILE_BYTES (TILE_PIXELS * IMAGE_DEPTH)
+#define PALETTE_MAX 256 // colors of an indexed canvas
+#define MIP_TILE_SHIFT TILE_SHIFT // edits mark tiles dirty
+#define MIP_LEVELS_MAX 12
+#define ZOOM_IN_MAX 3 // up to 8 cells per pixel
+#define LAYERS_MAX 16
+#define LAYER_OPACITY_STEP 16
+#define BLEND_NORMAL 0
+#define BLEND_MULTIPLY 1
+#define BLEND_SCREEN 2
+#define BLEND_MODES 3
+#define CHECKER_SHIFT 2 // squares of 4x4 pixels
+#define BUFFER_RESIDENT 0 // the canvases are in memory
+#define BUFFER_PACKED 1 // they are compressed snapshots in memory
+#define BUFFER_SPILLED 2 // the snapshots are files in the temp dir
+#define BUFFER_UNLOADED 3 // the file wasn't opened yet
+#define BLIT_SKIP_TRANSPARENT 1 // transparent pixels keep what is below
+#define INPUT_BUF_SIZE 1024
+#define ESC_TIMEOUT_MS 25 // wait for the rest of an escape sequence
+#define CURSOR_REPORT_TIMEOUT_MS 1000
+#define CSI_PARAMS_MAX 4
+#define COUNT_MAX 100000
+#define WHEEL_STEPS 3 // cells the mouse wheel scrolls by
+
+// keys which don't fit a byte (decoded from escape sequences)
+#define KEY_NONE 1000 // an unknown sequence
+#define KEY_LEFT 1001
+#define KEY_RIGHT 1002
+#define KEY_UP 1003
+#define KEY_DOWN 1004
+#define KEY_HOME 1005
+#define KEY_END 1006
+#define KEY_PAGE_UP 1007
+#define KEY_PAGE_DOWN 1008
+#define KEY_DELETE 1009
+#define KEY_MOUSE 1010 // details are in mouse
+#define KEY_CURSOR_REPORT 1011 // answer to \x1b[6n, see cursor_report
+#define MOUSE_WHEEL 64 // buttons from here on are the wheel
+
+// colors of the cells on screen (0xRRGGBB)
+#define CELL_RGB(r, g, b) (((uint32_t)(r) << 16) | ((g) << 8) | (b))
+#define CELL_R(cell) (((cell) >> 16) & 0xFF)
+#define CELL_G(cell) (((cell) >> 8) & 0xFF)
+#define CELL_B(cell) ((cell) & 0xFF)
+#define CELL_EMPTY 0x01000000   // no image at this cell
+#define CELL_UNKNOWN 0x02000000 // content of the cell is not known
+
+// indices of the commands in commands
+#define CMD_QUIT 0
+#define CMD_MOVE_LEFT 1
+#define CMD_MOVE_DOWN 2
+#define CMD_MOVE_UP 3
+#define CMD_MOVE_RIGHT 4
+#define CMD_OFFSET_LEFT 5
+#define CMD_OFFSET_DOWN 6
+#define CMD_OFFSET_UP 7
+#define CMD_OFFSET_RIGHT 8
+#define CMD_MOVE_TOP 9
+#define CMD_MOVE_BOTTOM 10
+#define CMD_FILL 11
+#define CMD_DELETE 12
+#define CMD_SELECT 13
+#define CMD_JUMP_FORWARD 14
+#define CMD_JUMP_BACKWARD 15
+#define CMD_COLOR_0 16
+#define CMD_COLOR_1 17
+#define CMD_COLOR_2 18
+#define CMD_COLOR_3 19
+#define CMD_COLOR_4 20
+#define CMD_COLOR_5 21
+#define CMD_COLOR_6 22
+#define CMD_COLOR_7 23
+#define CMD_COLOR_8 24
+#define CMD_COLOR_9 25
+#define CMD_SAVE 26
+#define CMD_RELOAD 27
+#define CMD_PIPETTE 28
+#define CMD_PIPETTE_SAVE 29
+#define CMD_BUCKET_FILL 30
+#define CMD_UNDO 31
+#define CMD_REDO 32
+#define CMD_SAVE_FAST 33
+#define CMD_ZOOM_IN 34
+#define CMD_ZOOM_OUT 35
+#define CMD_HALF_BLOCK 36
+#define CMD_LAYER_ADD 37
+#define CMD_LAYER_DELETE 38
+#define CMD_LAYER_UP 39
+#define CMD_LAYER_DOWN 40
+#define CMD_LAYER_VISIBLE 41
+#define CMD_LAYER_OPACITY_UP 42
+#define CMD_LAYER_OPACITY_DOWN 43
+#define CMD_LAYER_BLEND 44
+#define CMD_INDEXED 45
+#define CMD_RECOLOR 46
+#define CMD_YANK 47
+#define CMD_PASTE 48
+#define CMD_MOVE 49
+#define CMD_FLIP_HORIZONTAL 50
+#define CMD_FLIP_VERTICAL 51
+#define CMD_ROTATE 52
+#define CMD_BUFFER_NEXT 53
+#define CMD_BUFFER_PREVIOUS 54
+#define COMMANDC (CMD_BUFFER_PREVIOUS + 1)
 
 /*** data ***/
 
 // struct to save the terminal configuration
+// (rows and cols count cells, see update_view_size)
 struct term_config {
   int rows;
   int cols;
+  int lines; // terminal lines for the image (without the status line)
+  int width; // terminal columns
   struct termios origin;
 };
 
+// with half blocks a char shows two cells above each other
+// (upper half block with the top cell as foreground and the
+//  bottom cell as background), else a cell is two spaces wide
+int half_block = 0;
+
+// write color channels without leading zeros (;7; instead of ;007;)
+int short_escapes = 0;
+
 struct term_config term;
 
-int x_cursor = 1;
-int y_cursor = 1;
+// buffer which collects everything that is written in one go
+struct abuf {
+  char *b;
+  int len;
+  int cap;
+};
+
+// struct to hold what is on screen (front) and what should be (back)
+// (one cell per pixel when not zoomed)
+struct frame {
+  int rows;
+  int cols;
+  uint32_t *front;
+  uint32_t *back;
+  int x_offset; // offsets the front buffer was drawn with (in cells)
+  int y_offset;
+  int cursor_row; // cursor position the terminal was last sent
+  int cursor_col;
+  char status[STATUS_MAX]; // status line the terminal shows
+  struct abuf out;
+};
+
+struct frame frame;
+
+// where frames are written to and how many bytes were written
+// (the bench points it at /dev/null)
+int frame_fd = STDOUT_FILENO;
+size_t frame_bytes_written = 0;
+
+// while set render_frame only marks the frame as pending, so all
+// keys which arrived together are handled before drawing once
+int defer_render = 0;
+int render_pending = 0;
+
+// keys read from stdin which weren't handled yet
+struct input_buffer {
+  char buf[INPUT_BUF_SIZE];
+  int len;
+  int pos;
+  int hold; // read bytes are kept for later, new ones are appended
+};
+
+struct input_buffer input;
+
+// the last mouse event (sgr mouse reporting)
+struct mouse_event {
+  int button; // 0 left, 1 middle, 2 right, MOUSE_WHEEL up / down
+  int line; // terminal position
+  int col;
+  int pressed; // 0 when the button was released
+  int motion; // moved while a button is held
+};
+
+struct mouse_event mouse;
+
+// report mouse events, can be turned off in the config
+// (the terminal can't select text while they are reported)
+int mouse_reporting = 1;
+
+// position of the last cursor position report
+int cursor_report[2];
+
+// cursor position on screen in pixels
+// (the terminal is never asked for it, this is the real position)
+int x_cursor = 0;
+int y_cursor = 0;
+
+// struct to hold the pixels of an image
+//
+// the pixels are stored in tiles of TILE_SIZE x TILE_SIZE pixels 
+// (packed rgba, IMAGE_DEPTH bytes per pixel, row after row), 
+// tiles which were never drawn on are NULL and fully transparent
+// so memory only grows with what is drawn
+//
+// indexed canvases store one byte per pixel instead, the index of
+// its color in the palette (missing tiles are still transparent)
+struct canvas {
+  unsigned int width;
+  unsigned int height;
+  int tile_rows;
+  int tile_cols;
+  unsigned char **tiles;
+  struct palette *palette; // NULL unless the canvas is indexed
+};
+
+// the colors of an indexed canvas (rgba, transparent entries have
+// the transparency color like all transparent pixels)
+struct palette {
+  unsigned char colors[PALETTE_MAX][IMAGE_DEPTH];
+  int count;
+  int last; // the entry found by the last lookup
+};
+
+// what missing tiles look like (the transparency color, alpha 0)
+unsigned char *empty_tile = NULL;
+
+struct canvas image;
+
+// header of the binary snapshot format (.pcli_failsave)
+// followed by the raw rgba rows or by blocks of SNAPSHOT_BLOCK_ROWS
+// rows, each one prefixed with its raw and its compressed size
+// (the numbers are stored in host byte order, snapshots are only
+// read back on the machine which wrote them)
+struct snapshot_header {
+  char magic[4];
+  uint16_t version;
+  uint16_t flags;
+  uint32_t width;
+  uint32_t height;
+  uint32_t checksum; // crc32 of the raw pixels
+  uint32_t blockc; // amount of compressed blocks
+};
+
+int snapshot_compression = 0;
+
+// settings of the png export
+// (compression is the zlib level or -1 for the default, filters a mask
+//  of PNG_FILTER_* and threads > 1 uses the parallel encoder)
+struct png_settings {
+  int compression;
+  int filters;
+  int threads;
+};
+
+struct png_settings png_settings = { -1, PNG_FILTER_DEFAULT_MASK, 1 };
+// preset of the save_fast command (0 threads means one per core)
+struct png_settings png_fast_settings = { 1, PNG_FILTER_SUB, 0 };
+
+char save_path[PATH_MAX] = "./out.png";
+// set once the config or -o chose the save path
+int save_path_set = 0;
+
+// set when running a script without a terminal (--batch)
+int batch_mode = 0;
+
+// a command of a batch script with its arguments
+struct batch_cmd {
+  int inx; // index into commands
+  int argc;
+  int args[6];
+  char path[PATH_MAX]; // only used by save and save_fast
+  int line;
+};
+
+// a band of rows that is deflated by one thread of the parallel encoder
+struct deflate_band {
+  const struct canvas *canvas;
+  const struct png_settings *settings;
+  int from; // first row
+  int to; // row after the last row
+  int last;
+  unsigned char *out;
+  size_t len;
+  uLong adler; // adler32 of the filtered rows
+  int result;
+  pthread_t thread;
+  int threaded; // set if thread deflates the band
+};
+
+// a save running in the background on a copy of the image
+struct save_job {
+  struct canvas canvas;
+  struct png_settings settings;
+  char path[PATH_MAX];
+  int result;
+};
+
+struct save_job save_job;
+pthread_t save_thread;
+int save_running = 0;
+
+// pipe to wake up the input loop from other threads
+int event_pipe[2] = { -1, -1 };
+// set by the SIGWINCH handler until the input loop measured the terminal
+volatile sig_atomic_t resize_pending = 0;
 
-char *image;
-unsigned int image_bytec;
-unsigned int image_width;
-unsigned int image_height;
+// message shown in the status line below the image
+char status_msg[STATUS_MAX] = "";
 int x_offset = 0;
 int y_offset = 0;
 
+// zoom level of the view: below 0 a cell shows 2^-zoom x 2^-zoom 
+// pixels, above 0 a pixel is shown with 2^zoom x 2^zoom cells
+// (zoomed out the offsets are multiples of the pixels per cell)
+int zoom = 0;
+
+// downsampled copies of the image for zooming out
+//
+// level k has one cell color for every 2^k x 2^k pixels, levels
+// are built when they are shown first and edits only mark tiles 
+// dirty which are recomputed before the next zoomed out frame
+struct mip_pyramid {
+  uint32_t *levels[MIP_LEVELS_MAX + 1]; // levels[0] is the image itself
+  int built; // levels 1..built exist
+  unsigned char *dirty; // one flag per tile
+  int tile_rows;
+  int tile_cols;
+  int any_dirty;
+};
+
+struct mip_pyramid mip;
+
+// a layer of the image, the layers are composited from the bottom up
+struct layer {
+  struct canvas canvas;
+  int visible;
+  int opacity; // 0 to 255
+  int blend; // BLEND_*
+};
+
+// the layers of the image, image holds their composite which is what
+// is drawn, saved and picked colors from
+//
+// until the stack is changed for the first time (composited is 0) 
+// the pixels of the only layer are image itself
+struct layer_stack {
+  struct layer items[LAYERS_MAX];
+  int count;
+  int active; // the layer edits go to
+  int composited;
+  unsigned char *dirty; // one flag per tile of the composite
+  int any_dirty;
+};
+
+struct layer_stack layers = { .items = { { .visible = 1, .opacity = 255 } }, 
+  .count = 1 };
+
+const char *blend_names[BLEND_MODES] = { "normal", "multiply", "screen" };
+
+// a canvas of a buffer which isn't current, packed into a compressed
+// snapshot (which is spilled to a file when memory gets short),
+// snapshots are rgba so the palette of indexed canvases is kept aside
+struct packed_canvas {
+  unsigned char *data; // NULL once spilled
+  size_t len;
+  struct palette *palette;
+  unsigned int width;
+  unsigned int height;
+};
+
+// a file of the session, the current one lives in the globals (image,
+// layers, history, offsets and cursor) while the others keep theirs 
+// here
+struct buffer {
+  char path[PATH_MAX]; // empty for a new image
+  int state; // BUFFER_*
+  unsigned long used; // buffer_clock when it was left
+  struct canvas image;
+  struct layer_stack layers;
+  struct history_entry *history;
+  int history_len;
+  int history_cap;
+  int history_pos;
+  size_t history_bytes;
+  int x_offset;
+  int y_offset;
+  int x_cursor;
+  int y_cursor;
+  // the layers (or the image if there is one) while packed
+  struct packed_canvas packed[LAYERS_MAX];
+};
+
+struct buffer *buffers = NULL;
+int bufferc = 0;
+int current_buffer = 0;
+unsigned long buffer_clock = 0;
+// the least recently used buffers are packed and then spilled
+// while the canvases of all of them take more memory than this
+size_t buffer_budget = 256 * 1024 * 1024;
+
 int selected_row = -1;
 int selected_col = -1;
 
+// pixels copied from the image (rgba, row after row)
+struct clipboard {
+  int width;
+  int height;
+  unsigned char *pixels;
+};
+
+struct clipboard clipboard;
+
+// a selection which is moved to the cursor with the next move
+// (rows and cols are inclusive, from_row is -1 if there is none)
+struct selection_move {
+  int from_row;
+  int from_col;
+  int to_row;
+  int to_col;
+};
+
+struct selection_move pending_move = { -1, -1, -1, -1 };
+
+// transparent pixels of the clipboard leave the image below them 
+// as it is when pasting (can be turned off in the config)
+int paste_skip_transparent = 1;
+
 int r_sel = 0;
 int g_sel = 0;
 int b_sel = 0;
+int a_sel = 255;
 
 int color_palette[10][3] = {
   {0x00, 0x00, 0x00}, // BLACK
@@ -71,1076 +504,5154 @@ int color_palette[10][3] = {
 };
 
 int transparency_color[3] = {0x00, 0x0A, 0x12};
+// transparent pixels are shown on a checkerboard of the 
+// transparency color and this one
+int checker_color[3] = {0x10, 0x1C, 0x26};
 
-char *commands[COMMANDC][2] = {
-  {"quit", "q"},
-  {"move_left", "h"},
-  {"move_down", "j"},
-  {"move_up", "k"},
-  {"move_right", "l"},
-  {"offset_left", "H"},
-  {"offset_down", "J"},
-  {"offset_up", "K"},
-  {"offset_right", "L"},
-  {"move_top", "g"},
-  {"move_bottom", "G"},
-  {"fill", "f"},
-  {"delete", "d"},
-  {"select", "v"},
-  {"jump_forward", "w"},
-  {"jump_backward", "b"},
-  {"color_0", "0"},
-  {"color_1", "1"},
-  {"color_2", "2"},
-  {"color_3", "3"},
-  {"color_4", "4"},
-  {"color_5", "5"},
-  {"color_6", "6"},
-  {"color_7", "7"},
-  {"color_8", "8"},
-  {"color_9", "9"},
-  {"save", "s"},
-  {"reload", "r"},
-  {"pipette", "i"},
-  {"pipette_save", "I"}
-};
+// settings of the bucket fill
+// (connectivity is 4 or 8, tolerance is the max difference per channel)
+int fill_connectivity = 4;
+int fill_tolerance = 0;
 
-char *error_msg = NULL;
+// span of filled pixels in a row which still has to be expanded
+struct fill_span {
+  int row;
+  int from;
+  int to;
+};
 
-/*** terminal ***/
+// a span of pixels in a row which was changed by a command
+// (old_runs and new_runs are the amount of runs it owns in the entry)
+struct history_span {
+  int row;
+  int col;
+  int len;
+  int old_runs;
+  int new_runs;
+};
 
-void disable_raw_mode() {
-  // clear screen
-  write(STDOUT_FILENO, "\x1b[2J", 4);
-  write(STDOUT_FILENO, "\x1b[H", 3);
+// run of count equal pixels
+struct history_run {
+  uint32_t count;
+  unsigned char color[IMAGE_DEPTH];
+};
 
-  // set original terminal configuration
-  if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &term.origin) == -1) {
-    exit(2);
-  }
+struct history_runs {
+  struct history_run *runs;
+  size_t runc;
+  size_t cap;
+};
 
-  // print error if there is one
-  if (error_msg != NULL) {
-    printf("%s", error_msg);
-  }
-}
+// everything one command changed, saved as run-length encoded spans
+// with the pixels from before (old) and after (new) the command
+struct history_entry {
+  struct history_span *spans;
+  int spanc;
+  int span_cap;
+  struct history_runs old;
+  struct history_runs new;
+  size_t bytes;
+  int layer; // the layer the pixels belong to
+};
 
-void die(const char* s) {
-  // create error message
-  error_msg = malloc(sizeof(char) * 32);
-  sprintf(error_msg, "ERROR: %s", s);
+// undo/redo stack, entries before history_pos can be undone
+// and the ones after it can be redone
+struct history_entry *history = NULL;
+int history_len = 0;
+int history_cap = 0;
+int history_pos = 0;
+size_t history_bytes = 0;
+size_t history_budget = 64 * 1024 * 1024;
+struct history_entry history_current;
+int history_recording = 0;
+
+// work stack of the bucket fill (kept between fills)
+struct fill_span *fill_stack = NULL;
+size_t fill_stack_cap = 0;
+
+// a command the keys can be bound to, the table of them is next
+// to their handlers
+struct command {
+  const char *name;
+  char keys[BINDING_MAX]; // set by bind in the config
+  int (*run)(int arg, int count);
+  int arg; // passed to run, e.g. the palette index of color_N
+  int counted; // 1 if the count typed in front of it is used
+};
 
-  // exit program
-  exit(1);
-}
+// node of the trie of the key bindings, node 0 is the root
+struct key_node {
+  int inx; // command bound to the keys leading here or -1
+  int *next; // node of every following byte (0 for none), NULL for leaves
+};
 
-void enable_raw_mode() {
-  // save current terminal configuration
-  if (tcgetattr(STDIN_FILENO, &term.origin) == -1) {
-    die("tcgetattr");
-  }
-  atexit(disable_raw_mode);
+struct key_node *key_nodes = NULL;
+int key_nodec = 0;
+int key_node_cap = 0;
 
-  // enter raw mode
-  struct termios raw = term.origin;
-  raw.c_iflag &= ~(ICRNL | IXON);
-  raw.c_oflag &= ~(OPOST);
-  raw.c_lflag &= ~(ECHO | ICANON);
-  if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) {
-    die("tcsetattr");
-  }
-}
+char *error_msg = NULL;
 
-int get_cursor_pos(int *row, int *col) {
-  // ask terminal for cursor position
-  if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4) {
-    return -1;
-  }
+// the inner loops over pixels and cells, there is a scalar version
+// of them and vectorized ones which are picked at startup
+struct kernels {
+  const char *name;
+  // sets n pixels to px
+  void (*fill_pixels)(unsigned char *dst, const unsigned char *px, 
+      size_t n);
+  // counts the pixels from px on which are ref
+  size_t (*color_run)(const unsigned char *px, const unsigned char *ref, 
+      size_t n);
+  // the same going backwards from px
+  size_t (*color_run_rev)(const unsigned char *px, 
+      const unsigned char *ref, size_t n);
+  // gives pixels with alpha 0 the rgb of the transparency key
+  void (*key_alpha)(unsigned char *px, size_t n, const unsigned char *key);
+  // draws the pixels of src with their alpha scaled by opacity over dst
+  void (*blend_over)(unsigned char *dst, const unsigned char *src, 
+      size_t n, int opacity);
+  // counts the cells from cells on which are value
+  size_t (*cell_run)(const uint32_t *cells, uint32_t value, size_t n);
+  // counts the cells from a and b on which are the same
+  size_t (*same_cells)(const uint32_t *a, const uint32_t *b, size_t n);
+};
 
-  char buf[16];
-  for (int i = 0; i < sizeof(buf); i++) {
-    // read each char of the escape sequence
-    if (read(STDIN_FILENO, &buf[i], 1) != 1) {
-      buf[i] = '\0';
-      break;
-    }
-    // stop if R is reached (end of returned escape sequence)
-    if (buf[i] == 'R') {
-      buf[i] = '\0';
-      break;
-    }
-  }
-  
-  // check if an escape sequence was read
-  if (buf[0] != '\x1b' || buf[1] != '[') {
-    return -1;
-  }
+/*** kernels ***/
 
-  // extract values from buf
-  if (sscanf(&buf[2], "%d;%d", row, col) == -1) {
-    return -1;
+static void fill_pixels_scalar(unsigned char *dst, const unsigned char *px, 
+    size_t n) 
+{
+  for (size_t i = 0; i < n; i++, dst += IMAGE_DEPTH) {
+    memcpy(dst, px, IMAGE_DEPTH);
   }
+}
 
-  // convert to 0-based index
-  *row = *row - 1;
-  *col = *col - 1;
+static inline int same_pixel(const unsigned char *a, 
+    const unsigned char *b) 
+{
+  return memcmp(a, b, IMAGE_DEPTH) == 0;
+}
 
-  return 0;
+static size_t color_run_scalar(const unsigned char *px, 
+    const unsigned char *ref, size_t n) 
+{
+  size_t i = 0;
+  while (i < n && same_pixel(px, ref)) {
+    i++;
+    px += IMAGE_DEPTH;
+  }
+  return i;
 }
 
-/// initializes the image array
-///
-/// if rows are given those pixels will be loaded
-/// (color_type is needed to load correctly!
-///  if rows are given this function will panic and exit)
-/// 
-/// if no rows are given a blank image will be created
-/// (color_type will be ignored)
-int init_image(int w, int h, png_bytepp rows, int color_type) {
-  // init global image vars
-  // (2 * w because pixel has two chars in terminal)
-  // + 1 to accommodate the \0 character
-  image_bytec = (2 * w) * h * BYTES_PER_CHAR; 
-  image = malloc(image_bytec + 1);
-  image[2 * w * h * BYTES_PER_CHAR] = '\0';
-  image_width = w * 2;
-  image_height = h;
-
-  char r0 = (int)(transparency_color[0] / 100) + ASCII_NUMBERS_START;
-  char r1 = (int)((transparency_color[0] % 100) / 10) + ASCII_NUMBERS_START;
-  char r2 = (int)(transparency_color[0] % 10) + ASCII_NUMBERS_START;
-  char g0 = (int)(transparency_color[1] / 100) + ASCII_NUMBERS_START;
-  char g1 = (int)((transparency_color[1] % 100) / 10) + ASCII_NUMBERS_START;
-  char g2 = (int)(transparency_color[1] % 10) + ASCII_NUMBERS_START;
-  char b0 = (int)(transparency_color[2] / 100) + ASCII_NUMBERS_START;
-  char b1 = (int)((transparency_color[2] % 100) / 10) + ASCII_NUMBERS_START;
-  char b2 = (int)(transparency_color[2] % 10) + ASCII_NUMBERS_START;
-
-  if (rows && !color_type) {
-    die("color_type is needed");
+static size_t color_run_rev_scalar(const unsigned char *px, 
+    const unsigned char *ref, size_t n) 
+{
+  size_t i = 0;
+  while (i < n && same_pixel(px, ref)) {
+    i++;
+    px -= IMAGE_DEPTH;
   }
-  
-  int create_alpha = 0;
-  if (color_type == PNG_COLOR_TYPE_RGBA
-    || color_type == PNG_COLOR_TYPE_GA
-    || color_type == PNG_COLOR_TYPE_RGB_ALPHA
-    || color_type == PNG_COLOR_TYPE_GRAY_ALPHA)
-  {
-    create_alpha = 1;
-  }
-
-  for (int i = 0; i < image_bytec; i+=BYTES_PER_CHAR) {
-    if (rows) {
-      // NOTE: I know it does it double unnecessarily
-      //       but as it just increases the loading time and
-      //       not the responsiveness whilst editing
-      //       I'm just gonna ignore that for now and might 
-      //       fix it in the future
-
-      // calculate image coordinates in png struct
-      int row = (int)((i / BYTES_PER_CHAR) / (2 * w));
-      int col = (int)(((i / BYTES_PER_CHAR) / 2) % w) * IMAGE_DEPTH;
-
-      // extract rgb values
-      int red = rows[row][col];
-      int green = rows[row][col + 1];
-      int blue = rows[row][col + 2];
-
-      // replace pixel color if it should 
-      // be totally transparent
-      if (create_alpha == 1 && rows[row][col + 3] == 0) {
-        red = transparency_color[0];
-        green = transparency_color[1];
-        blue = transparency_color[2];
-      }
+  return i;
+}
 
-      // put the correct chars into the variables
-      r0 = (int)(red / 100) + ASCII_NUMBERS_START;
-      r1 = (int)((red % 100) / 10) + ASCII_NUMBERS_START;
-      r2 = (int)(red % 10) + ASCII_NUMBERS_START;
-      g0 = (int)(green / 100) + ASCII_NUMBERS_START;
-      g1 = (int)((green % 100) / 10) + ASCII_NUMBERS_START;
-      g2 = (int)(green % 10) + ASCII_NUMBERS_START;
-      b0 = (int)(blue / 100) + ASCII_NUMBERS_START;
-      b1 = (int)((blue % 100) / 10) + ASCII_NUMBERS_START;
-      b2 = (int)(blue % 10) + ASCII_NUMBERS_START;
-    }
-
-    image[i + 0] = '\x1b';
-    image[i + 1] = '[';
-    image[i + 2] = '4';
-    image[i + 3] = '8';
-    image[i + 4] = ';';
-    image[i + 5] = '2';
-    image[i + 6] = ';';
-    image[i + 7] = r0;
-    image[i + 8] = r1;
-    image[i + 9] = r2;
-    image[i + 10] = ';';
-    image[i + 11] = g0;
-    image[i + 12] = g1;
-    image[i + 13] = g2;
-    image[i + 14] = ';';
-    image[i + 15] = b0;
-    image[i + 16] = b1;
-    image[i + 17] = b2;
-    image[i + 18] = 'm';
-    image[i + 19] = ' ';
-  }
-  if (rows) {
-    for (int i = 0; i < h; i++) {
-      png_bytep row = rows[i];
-      free(row);
+static void key_alpha_scalar(unsigned char *px, size_t n, 
+    const unsigned char *key) 
+{
+  for (size_t i = 0; i < n; i++, px += IMAGE_DEPTH) {
+    if (px[ALPHA_OFFSET] == 0) {
+      memcpy(px, key, IMAGE_DEPTH);
     }
-    free(rows);
   }
-  return 0;
 }
 
-int set_terminal_size() {
-  struct winsize ws;
-  int result = 0;
+/// t / 255 for t up to 255 * 255 without a division
+static inline int div255(int t) {
+  return (t + 1 + (t >> 8)) >> 8;
+}
 
-  // get terminal size with ioctl
-  if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || 
-      ws.ws_col == 0) {
-    // fallback to escape sequences for querying terminal size
-    // move cursor down and then to the end
-    if (write(STDOUT_FILENO, "\x1b[999C\x1b[999B", 12) != 12) {
-      return -1;
+/// draws the pixel src with its alpha scaled by opacity over dst
+/// (neither of them is premultiplied)
+static inline void blend_pixel(unsigned char *dst, const unsigned char *src, 
+    int opacity) 
+{
+  int a = div255(src[ALPHA_OFFSET] * opacity);
+  int below = dst[ALPHA_OFFSET];
+  if (a == 0) {
+    return;
+  }
+  if (below == 0) {
+    memcpy(dst, src, IMAGE_DEPTH);
+    dst[ALPHA_OFFSET] = a;
+    return;
+  }
+  if (below == 255) {
+    for (int ch = RED_OFFSET; ch <= BLUE_OFFSET; ch++) {
+      dst[ch] = div255(src[ch] * a + dst[ch] * (255 - a));
     }
-    // get cursor position with escape sequences
-    result = get_cursor_pos(&term.rows, &term.cols);
+    return;
   }
-  else {
-    // set term values with ioctl return values
-    term.cols = ws.ws_col / 2;
-    term.rows = ws.ws_row;
+  // the part of the pixel below which still shows
+  int shown = div255(below * (255 - a));
+  int out = a + shown;
+  for (int ch = RED_OFFSET; ch <= BLUE_OFFSET; ch++) {
+    dst[ch] = (src[ch] * a + dst[ch] * shown + out / 2) / out;
   }
-
-  return result;
+  dst[ALPHA_OFFSET] = out;
 }
 
-int init_terminal_state() {
-  enable_raw_mode();
-  return set_terminal_size();
+static void blend_over_scalar(unsigned char *dst, const unsigned char *src, 
+    size_t n, int opacity) 
+{
+  for (size_t i = 0; i < n; i++) {
+    blend_pixel(&dst[i * IMAGE_DEPTH], &src[i * IMAGE_DEPTH], opacity);
+  }
 }
 
-static inline int ASCII_TO_NUM(int inx) { 
-  return 
-    (  image[inx  ] - ASCII_NUMBERS_START) * 100 
-    + (image[inx + 1] - ASCII_NUMBERS_START) * 10 
-    + (image[inx + 2] - ASCII_NUMBERS_START); 
+static size_t cell_run_scalar(const uint32_t *cells, uint32_t value, 
+    size_t n) 
+{
+  size_t i = 0;
+  while (i < n && cells[i] == value) {
+    i++;
+  }
+  return i;
 }
 
-/// prints specified line to screen
-void println(int row, int col) {
-  // move cursor to beginning of line
-  write(STDOUT_FILENO, "\x1b[G", 3);
-  // clear line
-  write(STDOUT_FILENO, "\x1b[2K", 4);
-  // print screen to terminal
-  write(STDOUT_FILENO, 
-      &image[(row * image_width + col) * BYTES_PER_CHAR], 
-      MIN(term.cols, image_width - col) * BYTES_PER_CHAR);
-  // reset formatting
-  write(STDOUT_FILENO, "\x1b[0m", 4);
+static size_t same_cells_scalar(const uint32_t *a, const uint32_t *b, 
+    size_t n) 
+{
+  size_t i = 0;
+  while (i < n && a[i] == b[i]) {
+    i++;
+  }
+  return i;
 }
 
-/// prints specified lines to screen
-void printlns(int from_row, int to_row, int col) {
-  int f = MIN(from_row, to_row);
-  int t = MAX(from_row, to_row);
-  int draw_start = f - y_offset;
+const struct kernels scalar_kernels = {
+  "scalar", fill_pixels_scalar, color_run_scalar, color_run_rev_scalar,
+  key_alpha_scalar, blend_over_scalar, cell_run_scalar, same_cells_scalar
+};
 
-  // adjust starting row if it's offscreen
-  if (draw_start < 0) {
-    f = f + (draw_start * -1);
-    draw_start = 0;
-  }
+#ifdef X86_KERNELS
 
-  // adjust end to be last row if t is offscreen
-  t = MIN(t, term.rows + y_offset);
+// a pixel loaded as 32 bit word (x86 is little endian)
+#define PIXEL_ALPHA_BITS (0xFFu << (8 * ALPHA_OFFSET))
 
-  // place cursor to beginning of selection
-  char *buf = malloc(10);
-  int len = sprintf(buf, "\x1b[%d;1H", draw_start + 1);
-  write(STDOUT_FILENO, buf, len);
-  free(buf);
+static inline uint32_t load_pixel_word(const unsigned char *px) {
+  uint32_t word;
+  memcpy(&word, px, IMAGE_DEPTH);
+  return word;
+}
 
-  for (int i = f; i <= t; i++) {
-    println(i, col);
-    // cursor in next line
-    write(STDOUT_FILENO, "\x1b[E", 3);
+// sse2 kernels, 4 pixels at once
+
+__attribute__((target("sse2")))
+static void fill_pixels_sse2(unsigned char *dst, const unsigned char *px, 
+    size_t n) 
+{
+  __m128i v = _mm_set1_epi32(load_pixel_word(px));
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    _mm_storeu_si128((__m128i *)&dst[i * IMAGE_DEPTH], v);
   }
+  fill_pixels_scalar(&dst[i * IMAGE_DEPTH], px, n - i);
 }
 
-/// prints the whole screen based on the offsets
-void print_screen() {
-  // move cursor to beginning of screen
-  write(STDOUT_FILENO, "\x1b[H", 3);
-
-  for (int i = y_offset; 
-      i < MIN(term.rows + y_offset, image_height); i++) 
-  {
-    println(i, x_offset);
-    // cursor in next line
-    write(STDOUT_FILENO, "\x1b[E", 3);
+__attribute__((target("sse2")))
+static size_t color_run_sse2(const unsigned char *px, 
+    const unsigned char *ref, size_t n) 
+{
+  __m128i v = _mm_set1_epi32(load_pixel_word(ref));
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128i p = _mm_loadu_si128((const __m128i *)&px[i * IMAGE_DEPTH]);
+    int eq = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(p, v)));
+    if (eq != 0xF) {
+      return i + __builtin_ctz(~eq);
+    }
   }
+  return i + color_run_scalar(&px[i * IMAGE_DEPTH], ref, n - i);
 }
 
-/// returns the starting index of given coordinates in the image
-int get_inx(int row, int col) {
-  return (col + image_width * row) * BYTES_PER_CHAR;
+__attribute__((target("sse2")))
+static size_t color_run_rev_sse2(const unsigned char *px, 
+    const unsigned char *ref, size_t n) 
+{
+  __m128i v = _mm_set1_epi32(load_pixel_word(ref));
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    // the last lane is the pixel closest to px
+    __m128i p = _mm_loadu_si128(
+        (const __m128i *)(px - (i + 3) * IMAGE_DEPTH));
+    int eq = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(p, v)));
+    if (eq != 0xF) {
+      return i + __builtin_clz(~eq & 0xF) - 28;
+    }
+  }
+  return i + color_run_rev_scalar(px - i * IMAGE_DEPTH, ref, n - i);
 }
 
-static inline void set_pixel(int r, int g, int b, int base_offset)
+__attribute__((target("sse2")))
+static void key_alpha_sse2(unsigned char *px, size_t n, 
+    const unsigned char *key) 
 {
-  image[base_offset + RED_OFFSET] = (int)(r / 100) + ASCII_NUMBERS_START;
-  image[base_offset + RED_OFFSET + 1] = (int)((r % 100) / 10) + ASCII_NUMBERS_START;
-  image[base_offset + RED_OFFSET + 2] = (int)(r % 10) + ASCII_NUMBERS_START;
-  image[base_offset + GREEN_OFFSET] = (int)(g / 100) + ASCII_NUMBERS_START;
-  image[base_offset + GREEN_OFFSET + 1] = (int)((g % 100) / 10) + ASCII_NUMBERS_START;
-  image[base_offset + GREEN_OFFSET + 2] = (int)(g % 10) + ASCII_NUMBERS_START;
-  image[base_offset + BLUE_OFFSET] = (int)(b / 100) + ASCII_NUMBERS_START;
-  image[base_offset + BLUE_OFFSET + 1] = (int)((b % 100) / 10) + ASCII_NUMBERS_START;
-  image[base_offset + BLUE_OFFSET + 2] = (int)(b % 10) + ASCII_NUMBERS_START;
+  __m128i alpha = _mm_set1_epi32(PIXEL_ALPHA_BITS);
+  __m128i k = _mm_set1_epi32(load_pixel_word(key));
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128i *p = (__m128i *)&px[i * IMAGE_DEPTH];
+    __m128i v = _mm_loadu_si128(p);
+    __m128i transparent = _mm_cmpeq_epi32(_mm_and_si128(v, alpha), 
+        _mm_setzero_si128());
+    _mm_storeu_si128(p, _mm_or_si128(_mm_and_si128(transparent, k), 
+          _mm_andnot_si128(transparent, v)));
+  }
+  key_alpha_scalar(&px[i * IMAGE_DEPTH], n - i, key);
 }
 
-void pipette(int row, int col) {
-  int inx = get_inx(row, col);
-  r_sel = ASCII_TO_NUM(inx + RED_OFFSET);
-  g_sel = ASCII_TO_NUM(inx + GREEN_OFFSET);
-  b_sel = ASCII_TO_NUM(inx + BLUE_OFFSET);
+/// t / 255 in every 16 bit lane (see div255)
+__attribute__((target("sse2")))
+static inline __m128i div255_sse2(__m128i t) {
+  return _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(t, _mm_set1_epi16(1)), 
+        _mm_srli_epi16(t, 8)), 8);
 }
 
-/// fills the whole image with given color
-void fill_image(int r, int g, int b) {
-  for (int i = 0; i < image_bytec; i+= BYTES_PER_CHAR) {
-    set_pixel(r, g, b, i);
-  }
+/// blends two pixels of src over two opaque pixels of dst, 
+/// the channels are widened to 16 bit lanes
+__attribute__((target("sse2")))
+static inline __m128i lerp_pixels_sse2(__m128i d, __m128i s, 
+    __m128i opacity) 
+{
+  // the alpha of each pixel in the lanes of all its channels
+  __m128i a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s, 0xFF), 0xFF);
+  a = div255_sse2(_mm_mullo_epi16(a, opacity));
+  __m128i rest = _mm_sub_epi16(_mm_set1_epi16(255), a);
+  return div255_sse2(_mm_add_epi16(_mm_mullo_epi16(s, a), 
+        _mm_mullo_epi16(d, rest)));
 }
 
-/// fills a pixel with the given color 
-/// and redraws the affected line
-///
-/// index shall be absolute to the image coordinates
-void fill_pixel(int row, int col, int r, int g, int b) {
-  // abort if not in image
-  if (row >= image_height || col >= image_width - 1) {
-    return;
+__attribute__((target("sse2")))
+static void blend_over_sse2(unsigned char *dst, const unsigned char *src, 
+    size_t n, int opacity) 
+{
+  __m128i alpha = _mm_set1_epi32(PIXEL_ALPHA_BITS);
+  __m128i op = _mm_set1_epi16(opacity);
+  __m128i zero = _mm_setzero_si128();
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128i *p = (__m128i *)&dst[i * IMAGE_DEPTH];
+    __m128i d = _mm_loadu_si128(p);
+    // only pixels over opaque ones are a plain lerp
+    __m128i opaque = _mm_cmpeq_epi32(_mm_and_si128(d, alpha), alpha);
+    if (_mm_movemask_epi8(opaque) != 0xFFFF) {
+      blend_over_scalar(&dst[i * IMAGE_DEPTH], &src[i * IMAGE_DEPTH], 
+          4, opacity);
+      continue;
+    }
+    __m128i s = _mm_loadu_si128((const __m128i *)&src[i * IMAGE_DEPTH]);
+    __m128i lo = lerp_pixels_sse2(_mm_unpacklo_epi8(d, zero), 
+        _mm_unpacklo_epi8(s, zero), op);
+    __m128i hi = lerp_pixels_sse2(_mm_unpackhi_epi8(d, zero), 
+        _mm_unpackhi_epi8(s, zero), op);
+    _mm_storeu_si128(p, _mm_or_si128(_mm_packus_epi16(lo, hi), alpha));
   }
-  int inx = get_inx(row, col);
-  set_pixel(r, g, b, inx);
-  set_pixel(r, g, b, inx + BYTES_PER_CHAR);
+  blend_over_scalar(&dst[i * IMAGE_DEPTH], &src[i * IMAGE_DEPTH], 
+      n - i, opacity);
+}
 
-  // save cursor position
-  int row_save;
-  int col_save;
-  // get current cursor position
-  if (get_cursor_pos(&row_save, &col_save) == -1) {
-    die("get_cursor_pos");
-    return;
-  }
+// the runs of cells on the screen are mostly a few cells short,
+// the vector versions of cell_run and same_cells were slower there
+const struct kernels sse2_kernels = {
+  "sse2", fill_pixels_sse2, color_run_sse2, color_run_rev_sse2,
+  key_alpha_sse2, blend_over_sse2, cell_run_scalar, same_cells_scalar
+};
 
-  println(row, x_offset);
+// avx2 kernels, 8 pixels at once
+//
+// the upper halves of the ymm registers are cleared before calling
+// code without vex encoding, else every sse instruction after it
+// is slowed down (for the rest of the program)
 
-  // reset cursor position
-  char *buf = malloc(10);
-  int len = sprintf(buf, "\x1b[%d;%dH", row_save + 1, col_save + 1);
-  write(STDOUT_FILENO, buf, len);
-  free(buf);
+__attribute__((target("avx2")))
+static void fill_pixels_avx2(unsigned char *dst, const unsigned char *px, 
+    size_t n) 
+{
+  __m256i v = _mm256_set1_epi32(load_pixel_word(px));
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    _mm256_storeu_si256((__m256i *)&dst[i * IMAGE_DEPTH], v);
+  }
+  _mm256_zeroupper();
+  fill_pixels_scalar(&dst[i * IMAGE_DEPTH], px, n - i);
 }
 
-/// fills a range of pixels with the given color 
-/// and redraws affected lines
-///
-/// index shall be absolute to the image coordinates
-void fill_selection(int from_r, int from_c, 
-    int to_r, int to_c,
-    int r, int g, int b) {
-  // abort if not in image
-  if (from_r >= image_height || from_c >= image_width - 1 ||
-    to_r >= image_height || to_c >= image_width - 1) {
-    return;
+__attribute__((target("avx2")))
+static size_t color_run_avx2(const unsigned char *px, 
+    const unsigned char *ref, size_t n) 
+{
+  __m256i v = _mm256_set1_epi32(load_pixel_word(ref));
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i p = _mm256_loadu_si256((const __m256i *)&px[i * IMAGE_DEPTH]);
+    int eq = _mm256_movemask_ps(
+        _mm256_castsi256_ps(_mm256_cmpeq_epi32(p, v)));
+    if (eq != 0xFF) {
+      return i + __builtin_ctz(~eq);
+    }
   }
+  _mm256_zeroupper();
+  return i + color_run_scalar(&px[i * IMAGE_DEPTH], ref, n - i);
+}
 
-  int start_col = MIN(from_c, to_c) * BYTES_PER_CHAR;
-  int end_col = (MAX(from_c, to_c) + 1) * BYTES_PER_CHAR;
-  int start_row = MIN(from_r, to_r) 
-    * image_width * BYTES_PER_CHAR;
-  int end_row = MAX(from_r, to_r) 
-    * image_width * BYTES_PER_CHAR;
-
-  for (int row = start_row; row <= end_row; 
-     row+=image_width*BYTES_PER_CHAR) 
-  {
-    for (int col = start_col; col <= end_col; 
-       col+=BYTES_PER_CHAR) 
-    {
-      set_pixel(r, g, b, row + col);
+__attribute__((target("avx2")))
+static size_t color_run_rev_avx2(const unsigned char *px, 
+    const unsigned char *ref, size_t n) 
+{
+  __m256i v = _mm256_set1_epi32(load_pixel_word(ref));
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    // the last lane is the pixel closest to px
+    __m256i p = _mm256_loadu_si256(
+        (const __m256i *)(px - (i + 7) * IMAGE_DEPTH));
+    int eq = _mm256_movemask_ps(
+        _mm256_castsi256_ps(_mm256_cmpeq_epi32(p, v)));
+    if (eq != 0xFF) {
+      return i + __builtin_clz(~eq & 0xFF) - 24;
     }
   }
+  _mm256_zeroupper();
+  return i + color_run_rev_scalar(px - i * IMAGE_DEPTH, ref, n - i);
+}
 
-  // save cursor position
-  int row_save;
-  int col_save;
-  // get current cursor position
-  if (get_cursor_pos(&row_save, &col_save) == -1) {
-    die("get_cursor_pos");
-    return;
+__attribute__((target("avx2")))
+static void key_alpha_avx2(unsigned char *px, size_t n, 
+    const unsigned char *key) 
+{
+  __m256i alpha = _mm256_set1_epi32(PIXEL_ALPHA_BITS);
+  __m256i k = _mm256_set1_epi32(load_pixel_word(key));
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i *p = (__m256i *)&px[i * IMAGE_DEPTH];
+    __m256i v = _mm256_loadu_si256(p);
+    __m256i transparent = _mm256_cmpeq_epi32(_mm256_and_si256(v, alpha), 
+        _mm256_setzero_si256());
+    _mm256_storeu_si256(p, _mm256_blendv_epi8(v, k, transparent));
   }
+  _mm256_zeroupper();
+  key_alpha_scalar(&px[i * IMAGE_DEPTH], n - i, key);
+}
 
-  printlns(from_r, to_r, x_offset);
-
-  // reset cursor position
-  char *buf = malloc(10);
-  int len = sprintf(buf, "\x1b[%d;%dH", row_save + 1, col_save + 1);
-  write(STDOUT_FILENO, buf, len);
-  free(buf);
+__attribute__((target("avx2")))
+static inline __m256i div255_avx2(__m256i t) {
+  return _mm256_srli_epi16(_mm256_add_epi16(
+        _mm256_add_epi16(t, _mm256_set1_epi16(1)), 
+        _mm256_srli_epi16(t, 8)), 8);
 }
 
-void clear_screen() {
-  // clear screen
-  write(STDOUT_FILENO, "\x1b[2J", 4);
-  // move cursor to beginning
-  write(STDOUT_FILENO, "\x1b[H", 3);
+__attribute__((target("avx2")))
+static inline __m256i lerp_pixels_avx2(__m256i d, __m256i s, 
+    __m256i opacity) 
+{
+  __m256i a = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(s, 0xFF), 0xFF);
+  a = div255_avx2(_mm256_mullo_epi16(a, opacity));
+  __m256i rest = _mm256_sub_epi16(_mm256_set1_epi16(255), a);
+  return div255_avx2(_mm256_add_epi16(_mm256_mullo_epi16(s, a), 
+        _mm256_mullo_epi16(d, rest)));
 }
 
-int save_pipette_color(char c) {
-  if (c < ASCII_NUMBERS_START || c > ASCII_NUMBERS_START + 9) {
-    return ERROR;
+__attribute__((target("avx2")))
+static void blend_over_avx2(unsigned char *dst, const unsigned char *src, 
+    size_t n, int opacity) 
+{
+  __m256i alpha = _mm256_set1_epi32(PIXEL_ALPHA_BITS);
+  __m256i op = _mm256_set1_epi16(opacity);
+  __m256i zero = _mm256_setzero_si256();
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i *p = (__m256i *)&dst[i * IMAGE_DEPTH];
+    __m256i d = _mm256_loadu_si256(p);
+    __m256i opaque = _mm256_cmpeq_epi32(_mm256_and_si256(d, alpha), alpha);
+    if (_mm256_movemask_epi8(opaque) != -1) {
+      _mm256_zeroupper();
+      blend_over_sse2(&dst[i * IMAGE_DEPTH], &src[i * IMAGE_DEPTH], 
+          8, opacity);
+      continue;
+    }
+    // unpacking and packing stay within the 128 bit halves
+    __m256i s = _mm256_loadu_si256((const __m256i *)&src[i * IMAGE_DEPTH]);
+    __m256i lo = lerp_pixels_avx2(_mm256_unpacklo_epi8(d, zero), 
+        _mm256_unpacklo_epi8(s, zero), op);
+    __m256i hi = lerp_pixels_avx2(_mm256_unpackhi_epi8(d, zero), 
+        _mm256_unpackhi_epi8(s, zero), op);
+    _mm256_storeu_si256(p, _mm256_or_si256(_mm256_packus_epi16(lo, hi), 
+          alpha));
   }
+  _mm256_zeroupper();
+  blend_over_scalar(&dst[i * IMAGE_DEPTH], &src[i * IMAGE_DEPTH], 
+      n - i, opacity);
+}
 
-  color_palette[c - ASCII_NUMBERS_START][0] = r_sel;
-  color_palette[c - ASCII_NUMBERS_START][1] = g_sel;
-  color_palette[c - ASCII_NUMBERS_START][2] = b_sel;
+const struct kernels avx2_kernels = {
+  "avx2", fill_pixels_avx2, color_run_avx2, color_run_rev_avx2,
+  key_alpha_avx2, blend_over_avx2, cell_run_scalar, same_cells_scalar
+};
 
-  return SUCCESS;
-}
+#endif
 
-/// compares the two pixels at the given indexes
-///
-/// returns 1 if they are different, 0 if they are the same 
-/// and -1 if there was an error
-int cmp_pixel_color_by_index(int inx1, int inx2) {
-  if (!image) {
-    return -1;
-  }
+const struct kernels *kernels = &scalar_kernels;
 
-  if (   image[inx1 + RED_OFFSET]   == image[inx2 + RED_OFFSET]
-    && image[inx1 + GREEN_OFFSET] == image[inx2 + GREEN_OFFSET]
-    && image[inx1 + BLUE_OFFSET]  == image[inx2 + BLUE_OFFSET])
-  {
-    return 0;
+/// picks the fastest kernels the cpu supports
+void init_kernels() {
+  kernels = &scalar_kernels;
+#ifdef X86_KERNELS
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    kernels = &avx2_kernels;
+  }
+  else if (__builtin_cpu_supports("sse2")) {
+    kernels = &sse2_kernels;
+  }
+#endif
+}
+
+/*** terminal ***/
+
+void disable_raw_mode() {
+  // stop mouse reporting
+  if (mouse_reporting) {
+    write(STDOUT_FILENO, "\x1b[?1002l\x1b[?1006l", 16);
+  }
+
+  // clear screen
+  write(STDOUT_FILENO, "\x1b[2J", 4);
+  write(STDOUT_FILENO, "\x1b[H", 3);
+
+  // set original terminal configuration
+  if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &term.origin) == -1) {
+    exit(2);
+  }
+
+  // print error if there is one
+  if (error_msg != NULL) {
+    printf("%s", error_msg);
+  }
+}
+
+void die(const char* s) {
+  // create error message
+  error_msg = malloc(sizeof(char) * 32);
+  sprintf(error_msg, "ERROR: %s", s);
+
+  // exit program
+  exit(1);
+}
+
+void enable_raw_mode() {
+  // save current terminal configuration
+  if (tcgetattr(STDIN_FILENO, &term.origin) == -1) {
+    die("tcgetattr");
+  }
+  atexit(disable_raw_mode);
+
+  // enter raw mode
+  struct termios raw = term.origin;
+  raw.c_iflag &= ~(ICRNL | IXON);
+  raw.c_oflag &= ~(OPOST);
+  raw.c_lflag &= ~(ECHO | ICANON);
+  if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) {
+    die("tcsetattr");
+  }
+
+  // report presses, releases and drags in the sgr format
+  if (mouse_reporting) {
+    write(STDOUT_FILENO, "\x1b[?1002h\x1b[?1006h", 16);
+  }
+}
+
+/// returns the next byte of input if there is one within 
+/// timeout ms, else -1
+static int input_byte(int timeout) {
+  if (input.pos < input.len) {
+    return (unsigned char)input.buf[input.pos++];
+  }
+
+  if (!input.hold) {
+    input.len = 0;
+    input.pos = 0;
+  }
+  if (input.len == sizeof(input.buf)) {
+    return -1;
+  }
+
+  struct pollfd fd = { .fd = STDIN_FILENO, .events = POLLIN };
+  if (poll(&fd, 1, timeout) <= 0) {
+    return -1;
+  }
+  ssize_t nread = read(STDIN_FILENO, input.buf + input.len, 
+      sizeof(input.buf) - input.len);
+  if (nread <= 0) {
+    return -1;
+  }
+  input.len += nread;
+  return (unsigned char)input.buf[input.pos++];
+}
+
+/// decodes the rest of a CSI sequence (\x1b[ params final)
+static int decode_csi() {
+  int params[CSI_PARAMS_MAX] = { 0 };
+  int paramc = 1;
+  int marker = 0; // '<' of sgr mouse reports, '?' of private modes
+  int c;
+
+  while (1) {
+    c = input_byte(ESC_TIMEOUT_MS);
+    if (c == -1) {
+      return KEY_NONE;
+    }
+    if (c >= '0' && c <= '9') {
+      int *p = &params[MIN(paramc, CSI_PARAMS_MAX) - 1];
+      *p = MIN(*p * 10 + c - '0', COUNT_MAX);
+    }
+    else if (c == ';') {
+      paramc++;
+    }
+    else if (c >= '<' && c <= '?') {
+      marker = c;
+    }
+    else if (c < 0x20 || c > 0x2F) {
+      // everything but intermediate bytes ends the sequence
+      break;
+    }
+  }
+
+  if (marker == '<' && (c == 'M' || c == 'm') && paramc >= 3) {
+    mouse.button = params[0] & (3 | MOUSE_WHEEL);
+    mouse.motion = (params[0] & 32) != 0;
+    mouse.col = params[1] - 1;
+    mouse.line = params[2] - 1;
+    mouse.pressed = c == 'M';
+    return KEY_MOUSE;
+  }
+  if (marker) {
+    return KEY_NONE;
+  }
+
+  switch (c) {
+    case 'A': return KEY_UP;
+    case 'B': return KEY_DOWN;
+    case 'C': return KEY_RIGHT;
+    case 'D': return KEY_LEFT;
+    case 'H': return KEY_HOME;
+    case 'F': return KEY_END;
+    case 'R':
+      cursor_report[0] = params[0] - 1;
+      cursor_report[1] = params[1] - 1;
+      return KEY_CURSOR_REPORT;
+    case '~':
+      switch (params[0]) {
+        case 1: case 7: return KEY_HOME;
+        case 4: case 8: return KEY_END;
+        case 3: return KEY_DELETE;
+        case 5: return KEY_PAGE_UP;
+        case 6: return KEY_PAGE_DOWN;
+      }
+      break;
+  }
+  return KEY_NONE;
+}
+
+/// turns the byte c and the escape sequence it may start
+/// into a key (a byte or one of KEY_*)
+///
+/// a lone escape is returned as it is if nothing follows it
+/// within ESC_TIMEOUT_MS
+int decode_key(int c) {
+  if (c != '\x1b') {
+    return c;
+  }
+
+  int next = input_byte(ESC_TIMEOUT_MS);
+  if (next == '[') {
+    return decode_csi();
+  }
+  if (next == 'O') {
+    // SS3, sent by some terminals for the arrow keys
+    switch (input_byte(ESC_TIMEOUT_MS)) {
+      case 'A': return KEY_UP;
+      case 'B': return KEY_DOWN;
+      case 'C': return KEY_RIGHT;
+      case 'D': return KEY_LEFT;
+      case 'H': return KEY_HOME;
+      case 'F': return KEY_END;
+    }
+    return KEY_NONE;
+  }
+  if (next != -1) {
+    // not a sequence, the byte is a key of its own
+    input.pos--;
+  }
+  return c;
+}
+
+int get_cursor_pos(int *row, int *col) {
+  // ask terminal for cursor position
+  if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4) {
+    return -1;
+  }
+
+  // keys typed before the answer arrives stay in the input,
+  // only the answer is cut out of it
+  memmove(input.buf, input.buf + input.pos, input.len - input.pos);
+  input.len -= input.pos;
+  input.pos = 0;
+  input.hold = 1;
+  while (1) {
+    int from = input.pos;
+    int c = input_byte(CURSOR_REPORT_TIMEOUT_MS);
+    if (c == -1) {
+      input.pos = 0;
+      input.hold = 0;
+      return -1;
+    }
+    if (decode_key(c) == KEY_CURSOR_REPORT) {
+      memmove(input.buf + from, input.buf + input.pos, 
+          input.len - input.pos);
+      input.len -= input.pos - from;
+      break;
+    }
+  }
+  input.pos = 0;
+  input.hold = 0;
+
+  // 0-based already
+  *row = cursor_report[0];
+  *col = cursor_report[1];
+
+  return 0;
+}
+
+/// returns the position of given coordinates inside their tile
+static inline size_t get_pos(int row, int col) {
+  return (size_t)(row & (TILE_SIZE - 1)) * TILE_SIZE 
+    + (col & (TILE_SIZE - 1));
+}
+
+/// returns the starting index of given coordinates inside their tile
+static inline size_t get_inx(int row, int col) {
+  return get_pos(row, col) * IMAGE_DEPTH;
+}
+
+/// returns the slot of the tile holding the given pixel
+static inline unsigned char **get_tile(const struct canvas *c, 
+    int row, int col) 
+{
+  return &c->tiles[(size_t)(row >> TILE_SHIFT) * c->tile_cols 
+    + (col >> TILE_SHIFT)];
+}
+
+/// returns the given pixel for reading
+/// (pixels of missing tiles are read from the empty tile)
+static inline const unsigned char *get_pixel(const struct canvas *c, 
+    int row, int col) 
+{
+  const unsigned char *tile = *get_tile(c, row, col);
+  if (c->palette) {
+    return tile ? c->palette->colors[tile[get_pos(row, col)]] : empty_tile;
+  }
+  return (tile ? tile : empty_tile) + get_inx(row, col);
+}
+
+/// fills the empty tile with the current transparency color
+void update_empty_tile() {
+  if (!empty_tile) {
+    empty_tile = malloc(TILE_BYTES);
+    if (!empty_tile) {
+      die("malloc");
+    }
+  }
+  for (size_t i = 0; i < TILE_BYTES; i += IMAGE_DEPTH) {
+    empty_tile[i + RED_OFFSET] = transparency_color[0];
+    empty_tile[i + GREEN_OFFSET] = transparency_color[1];
+    empty_tile[i + BLUE_OFFSET] = transparency_color[2];
+    empty_tile[i + ALPHA_OFFSET] = 0;
+  }
+}
+
+/// returns the palette entry of the given rgba color,
+/// it is added if the palette doesn't have it yet
+///
+/// returns -1 if the palette is full
+static int palette_index(struct palette *p, const unsigned char *px) {
+  // edits mostly use the same color over and over
+  if (p->last < p->count 
+    && memcmp(p->colors[p->last], px, IMAGE_DEPTH) == 0) 
+  {
+    return p->last;
+  }
+  for (int i = 0; i < p->count; i++) {
+    if (memcmp(p->colors[i], px, IMAGE_DEPTH) == 0) {
+      p->last = i;
+      return i;
+    }
+  }
+  if (p->count == PALETTE_MAX) {
+    return -1;
+  }
+  memcpy(p->colors[p->count], px, IMAGE_DEPTH);
+  p->last = p->count;
+  return p->count++;
+}
+
+/// returns the palette entry which is closest to the given color
+static int palette_nearest(const struct palette *p, 
+    const unsigned char *px) 
+{
+  int best = 0;
+  long best_dist = LONG_MAX;
+  for (int i = 0; i < p->count; i++) {
+    long dist = 0;
+    for (int ch = 0; ch < IMAGE_DEPTH; ch++) {
+      long d = p->colors[i][ch] - px[ch];
+      dist += d * d;
+    }
+    if (dist < best_dist) {
+      best = i;
+      best_dist = dist;
+    }
+  }
+  return best;
+}
+
+/// returns the palette entry a pixel of the given color is stored as,
+/// colors which don't fit into a full palette get the closest entry
+static inline int palette_lookup(struct palette *p, 
+    const unsigned char *px) 
+{
+  int inx = palette_index(p, px);
+  return inx >= 0 ? inx : palette_nearest(p, px);
+}
+
+/// allocates a new tile of an indexed canvas with every pixel
+/// set to the given entry
+static unsigned char *alloc_index_tile(int inx) {
+  unsigned char *tile = malloc(TILE_PIXELS);
+  if (!tile) {
+    die("malloc");
+  }
+  memset(tile, inx, TILE_PIXELS);
+  return tile;
+}
+
+/// allocates a new tile of the canvas which is a copy of the empty tile
+static unsigned char *alloc_tile(struct canvas *c) {
+  if (c->palette) {
+    return alloc_index_tile(palette_lookup(c->palette, empty_tile));
+  }
+  unsigned char *tile = malloc(TILE_BYTES);
+  if (!tile) {
+    die("malloc");
+  }
+  memcpy(tile, empty_tile, TILE_BYTES);
+  return tile;
+}
+
+/// writes raw rgba bytes to a pixel of the canvas
+///
+/// missing tiles are only allocated if the pixel isn't
+/// the same as in the empty tile
+static inline void put_pixel(struct canvas *c, int row, int col, 
+    const unsigned char *px) 
+{
+  unsigned char **tile = get_tile(c, row, col);
+  if (!*tile) {
+    if (memcmp(px, empty_tile, IMAGE_DEPTH) == 0) {
+      return;
+    }
+    *tile = alloc_tile(c);
+  }
+  if (c->palette) {
+    (*tile)[get_pos(row, col)] = palette_lookup(c->palette, px);
+    return;
+  }
+  memcpy(*tile + get_inx(row, col), px, IMAGE_DEPTH);
+}
+
+/// converts a distance in cells to pixels of the image
+static inline int cells_to_pixels(int cells) {
+  return zoom < 0 ? cells << -zoom : cells >> zoom;
+}
+
+/// converts a distance in pixels of the image to cells
+static inline int pixels_to_cells(int pixels) {
+  return zoom < 0 ? pixels >> -zoom : pixels << zoom;
+}
+
+/// builds the rgba bytes of the given color
+///
+/// fully transparent pixels all get the transparency color, 
+/// so they are the same as the pixels of missing tiles
+static inline void make_pixel(int r, int g, int b, int a, 
+    unsigned char *px) 
+{
+  if (a == 0) {
+    r = transparency_color[0];
+    g = transparency_color[1];
+    b = transparency_color[2];
+  }
+  px[RED_OFFSET] = r;
+  px[GREEN_OFFSET] = g;
+  px[BLUE_OFFSET] = b;
+  px[ALPHA_OFFSET] = a;
+}
+
+/// returns the pixels of the given layer
+static inline struct canvas *layer_canvas(int inx) {
+  return layers.composited ? &layers.items[inx].canvas : &image;
+}
+
+/// returns the pixels of the layer edits go to
+static inline struct canvas *active_canvas() {
+  return layer_canvas(layers.active);
+}
+
+/// sets the given pixel of the active layer to the given color
+static inline void set_pixel(int r, int g, int b, int a, int row, int col)
+{
+  unsigned char px[IMAGE_DEPTH];
+  make_pixel(r, g, b, a, px);
+  put_pixel(active_canvas(), row, col, px);
+}
+
+/// sets the pixels from..to (inclusive) of a row of the active layer
+/// to the given color, tile by tile (see set_pixel)
+static void fill_span(int row, int from, int to, 
+    int r, int g, int b, int a) 
+{
+  if (from > to) {
+    return;
+  }
+  unsigned char px[IMAGE_DEPTH];
+  make_pixel(r, g, b, a, px);
+  struct canvas *c = active_canvas();
+
+  for (int col = from; col <= to; ) {
+    int tile_end = MIN(to, (col | (TILE_SIZE - 1)));
+    unsigned char **tile = get_tile(c, row, col);
+    if (!*tile && memcmp(px, empty_tile, IMAGE_DEPTH) == 0) {
+      col = tile_end + 1;
+      continue;
+    }
+    if (!*tile) {
+      *tile = alloc_tile(c);
+    }
+    if (c->palette) {
+      memset(*tile + get_pos(row, col), palette_lookup(c->palette, px), 
+          tile_end - col + 1);
+    }
+    else {
+      kernels->fill_pixels(*tile + get_inx(row, col), px, 
+          tile_end - col + 1);
+    }
+    col = tile_end + 1;
+  }
+}
+
+/// drops all levels of the mip pyramid, 
+/// they are rebuilt when they are needed again
+void mip_reset() {
+  for (int k = 1; k <= mip.built; k++) {
+    free(mip.levels[k]);
+    mip.levels[k] = NULL;
+  }
+  free(mip.dirty);
+  memset(&mip, 0, sizeof(mip));
+}
+
+/// marks the tiles of a span of changed pixels dirty
+void mip_mark(int row, int col, int len) {
+  if (mip.built == 0 || len <= 0) {
+    return;
+  }
+  int tile_row = row >> MIP_TILE_SHIFT;
+  unsigned char *dirty = &mip.dirty[(size_t)tile_row * mip.tile_cols];
+  for (int t = col >> MIP_TILE_SHIFT; 
+      t <= (col + len - 1) >> MIP_TILE_SHIFT; t++) 
+  {
+    dirty[t] = 1;
+  }
+  mip.any_dirty = 1;
+}
+
+/// creates the tile table of an empty (transparent) canvas
+/// returns ERROR if there is not enough memory
+int init_canvas(struct canvas *c, int w, int h) {
+  c->width = w;
+  c->height = h;
+  c->tile_rows = (h + TILE_SIZE - 1) >> TILE_SHIFT;
+  c->tile_cols = (w + TILE_SIZE - 1) >> TILE_SHIFT;
+  c->tiles = calloc((size_t)c->tile_rows * c->tile_cols, sizeof(*c->tiles));
+  c->palette = NULL;
+  return c->tiles ? SUCCESS : ERROR;
+}
+
+/// frees all tiles of a canvas
+void free_canvas(struct canvas *c) {
+  if (c->tiles) {
+    for (size_t i = 0; i < (size_t)c->tile_rows * c->tile_cols; i++) {
+      free(c->tiles[i]);
+    }
+  }
+  free(c->tiles);
+  free(c->palette);
+  memset(c, 0, sizeof(*c));
+}
+
+/// copies a canvas, only the tiles which exist are copied
+/// returns ERROR if there is not enough memory
+int copy_canvas(struct canvas *dst, const struct canvas *src) {
+  if (init_canvas(dst, src->width, src->height) == ERROR) {
+    return ERROR;
+  }
+  size_t tile_bytes = TILE_BYTES;
+  if (src->palette) {
+    dst->palette = malloc(sizeof(*dst->palette));
+    if (!dst->palette) {
+      free_canvas(dst);
+      return ERROR;
+    }
+    memcpy(dst->palette, src->palette, sizeof(*dst->palette));
+    tile_bytes = TILE_PIXELS;
+  }
+  for (size_t i = 0; i < (size_t)src->tile_rows * src->tile_cols; i++) {
+    if (!src->tiles[i]) {
+      continue;
+    }
+    dst->tiles[i] = malloc(tile_bytes);
+    if (!dst->tiles[i]) {
+      free_canvas(dst);
+      return ERROR;
+    }
+    memcpy(dst->tiles[i], src->tiles[i], tile_bytes);
+  }
+  return SUCCESS;
+}
+
+/// copies len pixels of a row from col on to buf 
+/// (len * IMAGE_DEPTH bytes)
+void read_span(const struct canvas *c, int row, int col, int len, 
+    unsigned char *buf) 
+{
+  if (c->palette) {
+    for (int i = 0; i < len; i++) {
+      memcpy(&buf[(size_t)i * IMAGE_DEPTH], get_pixel(c, row, col + i), 
+          IMAGE_DEPTH);
+    }
+    return;
+  }
+  // a memcpy for every tile the span is in
+  for (int i = 0, n; i < len; i += n) {
+    n = MIN(len - i, TILE_SIZE - ((col + i) & (TILE_SIZE - 1)));
+    memcpy(&buf[(size_t)i * IMAGE_DEPTH], get_pixel(c, row, col + i), 
+        (size_t)n * IMAGE_DEPTH);
+  }
+}
+
+/// copies buf (len * IMAGE_DEPTH bytes) to the pixels of a row 
+/// from col on, missing tiles are only allocated if the span doesn't 
+/// match the empty tile there
+void write_span(struct canvas *c, int row, int col, int len, 
+    const unsigned char *buf) 
+{
+  if (c->palette) {
+    for (int i = 0; i < len; i++) {
+      put_pixel(c, row, col + i, &buf[(size_t)i * IMAGE_DEPTH]);
+    }
+    return;
+  }
+  for (int i = 0, n; i < len; i += n) {
+    n = MIN(len - i, TILE_SIZE - ((col + i) & (TILE_SIZE - 1)));
+    size_t bytes = (size_t)n * IMAGE_DEPTH;
+    const unsigned char *src = &buf[(size_t)i * IMAGE_DEPTH];
+    unsigned char **tile = get_tile(c, row, col + i);
+    if (!*tile) {
+      if (memcmp(src, empty_tile, bytes) == 0) {
+        continue;
+      }
+      *tile = alloc_tile(c);
+    }
+    memcpy(*tile + get_inx(row, col + i), src, bytes);
+  }
+}
+
+/// copies a row of the canvas to buf (width * IMAGE_DEPTH bytes)
+void read_canvas_row(const struct canvas *c, int row, unsigned char *buf) {
+  read_span(c, row, 0, c->width, buf);
+}
+
+/// copies buf (width * IMAGE_DEPTH bytes) to a row of the canvas,
+/// missing tiles are only allocated if the row doesn't match
+/// the empty tile there
+void write_canvas_row(struct canvas *c, int row, const unsigned char *buf) {
+  write_span(c, row, 0, c->width, buf);
+}
+
+/// copies the palette entries of a row of an indexed canvas 
+/// to buf (width bytes), pixels of missing tiles get the entry empty
+void read_index_row(const struct canvas *c, int row, int empty, 
+    unsigned char *buf) 
+{
+  for (int col = 0; col < c->width; col += TILE_SIZE) {
+    int len = MIN(TILE_SIZE, (int)c->width - col);
+    const unsigned char *tile = *get_tile(c, row, col);
+    if (tile) {
+      memcpy(&buf[col], tile + get_pos(row, col), len);
+    }
+    else {
+      memset(&buf[col], empty, len);
+    }
+  }
+}
+
+/// copies palette entries (width bytes) to a row of an indexed canvas,
+/// missing tiles are only allocated if the row isn't transparent there
+void write_index_row(struct canvas *c, int row, const unsigned char *buf) {
+  for (int col = 0; col < c->width; col += TILE_SIZE) {
+    int len = MIN(TILE_SIZE, (int)c->width - col);
+    unsigned char **tile = get_tile(c, row, col);
+    if (!*tile) {
+      int i = 0;
+      while (i < len && c->palette->colors[buf[col + i]][ALPHA_OFFSET] == 0) {
+        i++;
+      }
+      if (i == len) {
+        continue;
+      }
+      *tile = alloc_index_tile(buf[col]);
+    }
+    memcpy(*tile + get_pos(row, col), &buf[col], len);
+  }
+}
+
+/// stores the pixels of a canvas with the given palette or as rgba 
+/// if it is NULL, the pixels have the same colors as before
+///
+/// the palette belongs to the canvas afterwards, on errors it is freed
+///
+/// returns ERROR if the colors don't fit into the palette or if there
+/// is not enough memory, the canvas is unchanged then
+static int recode_canvas(struct canvas *c, struct palette *palette) {
+  struct canvas converted;
+  unsigned char *rgba = malloc((size_t)c->width * IMAGE_DEPTH);
+  unsigned char *index = malloc(c->width);
+  if (!rgba || !index 
+    || init_canvas(&converted, c->width, c->height) == ERROR) 
+  {
+    free(rgba);
+    free(index);
+    free(palette);
+    return ERROR;
+  }
+  converted.palette = palette;
+
+  for (int row = 0; row < c->height; row++) {
+    read_canvas_row(c, row, rgba);
+    if (!palette) {
+      write_canvas_row(&converted, row, rgba);
+      continue;
+    }
+    for (int col = 0; col < c->width; col++) {
+      int inx = palette_index(palette, &rgba[col * IMAGE_DEPTH]);
+      if (inx < 0) {
+        free(rgba);
+        free(index);
+        free_canvas(&converted);
+        return ERROR;
+      }
+      index[col] = inx;
+    }
+    write_index_row(&converted, row, index);
+  }
+  free(rgba);
+  free(index);
+  free_canvas(c);
+  *c = converted;
+  return SUCCESS;
+}
+
+/// converts a canvas between rgba and indexed pixels, the pixels of
+/// a converted canvas have the same colors as before
+///
+/// returns ERROR if the canvas has more colors than fit into a palette
+/// or if there is not enough memory, the canvas is unchanged then
+int convert_canvas(struct canvas *c, int indexed) {
+  if (!c->palette == !indexed) {
+    return SUCCESS;
+  }
+  struct palette *palette = NULL;
+  if (indexed) {
+    palette = calloc(1, sizeof(*palette));
+    if (!palette) {
+      return ERROR;
+    }
+  }
+  return recode_canvas(c, palette);
+}
+
+/// drops all layers but a single one whose pixels are image again
+void reset_layers() {
+  if (layers.composited) {
+    for (int i = 0; i < layers.count; i++) {
+      free_canvas(&layers.items[i].canvas);
+    }
+    free(layers.dirty);
+  }
+  memset(&layers, 0, sizeof(layers));
+  layers.items[0].visible = 1;
+  layers.items[0].opacity = 255;
+  layers.count = 1;
+}
+
+/// marks a span of changed pixels of a layer, the composite and the
+/// mip levels are updated from the marks when they are needed
+void mark_dirty(int row, int col, int len) {
+  mip_mark(row, col, len);
+  if (!layers.composited || len <= 0) {
+    return;
+  }
+  unsigned char *dirty = &layers.dirty[(size_t)(row >> TILE_SHIFT) 
+    * image.tile_cols];
+  for (int t = col >> TILE_SHIFT; t <= (col + len - 1) >> TILE_SHIFT; t++) {
+    dirty[t] = 1;
+  }
+  layers.any_dirty = 1;
+}
+
+/// marks the tiles a layer has pixels in, e.g. after it was hidden
+/// (the mip pyramid uses the same tiles)
+void mark_layer_dirty(int inx) {
+  const struct canvas *c = layer_canvas(inx);
+  for (int t_row = 0; t_row < c->tile_rows; t_row++) {
+    for (int t_col = 0; t_col < c->tile_cols; t_col++) {
+      if (c->tiles[(size_t)t_row * c->tile_cols + t_col]) {
+        mark_dirty(t_row << TILE_SHIFT, t_col << TILE_SHIFT, 1);
+      }
+    }
+  }
+}
+
+/// gives the first layer pixels of its own so image can hold the
+/// composite, has to be called before the stack is changed
+void separate_layers() {
+  if (layers.composited) {
+    return;
+  }
+  layers.dirty = calloc((size_t)image.tile_rows * image.tile_cols, 1);
+  if (!layers.dirty) {
+    die("calloc");
+  }
+  // the composite of a single untouched layer is a copy of it,
+  // unless it is indexed as the composite is always rgba
+  layers.items[0].canvas = image;
+  if (image.palette) {
+    if (init_canvas(&image, image.width, image.height) == ERROR) {
+      die("calloc");
+    }
+    layers.composited = 1;
+    mark_layer_dirty(0);
+    return;
+  }
+  if (copy_canvas(&image, &layers.items[0].canvas) == ERROR) {
+    die("malloc");
+  }
+  layers.composited = 1;
+}
+
+/// blends a channel of a layer onto the one below it
+static inline int blend_channel(int blend, int below, int top) {
+  switch (blend) {
+    case BLEND_MULTIPLY:
+      return below * top / 255;
+    case BLEND_SCREEN:
+      return 255 - (255 - below) * (255 - top) / 255;
+    default:
+      return top;
+  }
+}
+
+/// draws the pixels of a layer's tile over the ones in dst
+static void blend_tile(unsigned char *dst, const unsigned char *src, 
+    const struct layer *l) 
+{
+  if (l->blend == BLEND_NORMAL) {
+    kernels->blend_over(dst, src, TILE_SIZE * TILE_SIZE, l->opacity);
+    return;
+  }
+  for (size_t i = 0; i < TILE_BYTES; i += IMAGE_DEPTH) {
+    // the blend mode gives the color drawn over the pixel below,
+    // there is nothing to blend with where it is transparent
+    unsigned char px[IMAGE_DEPTH];
+    memcpy(px, &src[i], IMAGE_DEPTH);
+    if (dst[i + ALPHA_OFFSET] != 0) {
+      for (int ch = RED_OFFSET; ch <= BLUE_OFFSET; ch++) {
+        px[ch] = blend_channel(l->blend, dst[i + ch], src[i + ch]);
+      }
+    }
+    blend_pixel(&dst[i], px, l->opacity);
+  }
+}
+
+/// returns the rgba pixels of a tile of a layer,
+/// the ones of indexed layers are looked up in a buffer
+static const unsigned char *layer_tile(const struct layer *l, size_t t) {
+  static unsigned char buf[TILE_BYTES];
+  const struct canvas *c = &l->canvas;
+  if (!c->palette) {
+    return c->tiles[t];
+  }
+  for (size_t i = 0; i < TILE_PIXELS; i++) {
+    memcpy(&buf[i * IMAGE_DEPTH], c->palette->colors[c->tiles[t][i]], 
+        IMAGE_DEPTH);
+  }
+  return buf;
+}
+
+/// composites a tile of the image from the visible layers,
+/// the tile is dropped if none of them has pixels there
+static void composite_tile(size_t t) {
+  const struct layer *drawn[LAYERS_MAX];
+  int drawnc = 0;
+  for (int i = 0; i < layers.count; i++) {
+    const struct layer *l = &layers.items[i];
+    if (l->visible && l->opacity > 0 && l->canvas.tiles[t]) {
+      drawn[drawnc++] = l;
+    }
+  }
+
+  if (drawnc == 0) {
+    free(image.tiles[t]);
+    image.tiles[t] = NULL;
+    return;
+  }
+  if (!image.tiles[t]) {
+    image.tiles[t] = alloc_tile(&image);
+  }
+
+  // an opaque bottom layer is copied as there is nothing below it
+  int i = 0;
+  if (drawn[0]->opacity == 255) {
+    memcpy(image.tiles[t], layer_tile(drawn[0], t), TILE_BYTES);
+    i = 1;
+  }
+  else {
+    memcpy(image.tiles[t], empty_tile, TILE_BYTES);
+  }
+  for (; i < drawnc; i++) {
+    blend_tile(image.tiles[t], layer_tile(drawn[i], t), drawn[i]);
+  }
+}
+
+/// brings the dirty tiles of the composite up to date
+void update_composite() {
+  if (!layers.any_dirty) {
+    return;
+  }
+  size_t tiles = (size_t)image.tile_rows * image.tile_cols;
+  for (size_t t = 0; t < tiles; t++) {
+    if (layers.dirty[t]) {
+      layers.dirty[t] = 0;
+      composite_tile(t);
+    }
+  }
+  layers.any_dirty = 0;
+}
+
+/// drops the image with its layers and mip levels
+void reset_image() {
+  mip_reset();
+  reset_layers();
+  free_canvas(&image);
+  update_empty_tile();
+}
+
+/// replaces the image with a new transparent one
+void alloc_canvas(int w, int h) {
+  reset_image();
+  if (init_canvas(&image, w, h) == ERROR) {
+    die("calloc");
+  }
+}
+
+/// initializes the image with a blank image
+/// (no tiles exist until something is drawn)
+int init_image(int w, int h) {
+  alloc_canvas(w, h);
+  return 0;
+}
+
+/// converts a row of loaded rgba pixels to the way 
+/// the image stores transparency
+static void normalize_row(unsigned char *buf, int width) {
+  unsigned char key[IMAGE_DEPTH];
+  make_pixel(0, 0, 0, 0, key);
+  kernels->key_alpha(buf, width, key);
+}
+
+/// returns how many chars wide a cell is
+static inline int chars_per_cell() {
+  return half_block ? 1 : 2;
+}
+
+/// returns how many rows of cells a terminal line shows
+static inline int cells_per_line() {
+  return half_block ? 2 : 1;
+}
+
+/// calculates how many cells fit on the screen in the current mode
+void update_view_size() {
+  term.rows = term.lines * cells_per_line();
+  term.cols = term.width / chars_per_cell();
+}
+
+int set_terminal_size() {
+  struct winsize ws;
+  int result = 0;
+
+  // get terminal size with ioctl
+  if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || 
+      ws.ws_col == 0) {
+    // fallback to escape sequences for querying terminal size
+    // move cursor down and then to the end
+    if (write(STDOUT_FILENO, "\x1b[999C\x1b[999B", 12) != 12) {
+      return -1;
+    }
+    // get cursor position with escape sequences
+    int row;
+    int col;
+    result = get_cursor_pos(&row, &col);
+    // convert the 0-based position of the last cell to a size
+    // (the last row is the status line)
+    term.lines = row;
+    term.width = col + 1;
+  }
+  else {
+    // set term values with ioctl return values
+    // (the last row is the status line)
+    term.width = ws.ws_col;
+    term.lines = ws.ws_row - 1;
+  }
+
+  update_view_size();
+  return result;
+}
+
+int init_terminal_state() {
+  enable_raw_mode();
+  return set_terminal_size();
+}
+
+/// wakes up the input loop when the terminal was resized, the pipe
+/// gets at most one byte until the loop handled it
+void handle_sigwinch(int sig) {
+  if (resize_pending) {
+    return;
+  }
+  int saved_errno = errno;
+  resize_pending = 1;
+  write(event_pipe[1], "w", 1);
+  errno = saved_errno;
+}
+
+/// lets SIGWINCH report resizes through the event pipe
+void install_resize_handler() {
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = handle_sigwinch;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_RESTART;
+  if (sigaction(SIGWINCH, &sa, NULL) == -1) {
+    die("sigaction");
+  }
+}
+
+// the three decimal digits of every channel value ("000" to "255"),
+// built by the preprocessor so escapes need no divisions
+#define DEC3(h, t, o) #h #t #o
+#define DEC3_10(h, t) DEC3(h, t, 0), DEC3(h, t, 1), DEC3(h, t, 2), \
+  DEC3(h, t, 3), DEC3(h, t, 4), DEC3(h, t, 5), DEC3(h, t, 6), \
+  DEC3(h, t, 7), DEC3(h, t, 8), DEC3(h, t, 9)
+#define DEC3_100(h) DEC3_10(h, 0), DEC3_10(h, 1), DEC3_10(h, 2), \
+  DEC3_10(h, 3), DEC3_10(h, 4), DEC3_10(h, 5), DEC3_10(h, 6), \
+  DEC3_10(h, 7), DEC3_10(h, 8), DEC3_10(h, 9)
+
+static const char channel_digits[256][4] = {
+  DEC3_100(0), DEC3_100(1), 
+  DEC3_10(2, 0), DEC3_10(2, 1), DEC3_10(2, 2), DEC3_10(2, 3), DEC3_10(2, 4),
+  DEC3(2, 5, 0), DEC3(2, 5, 1), DEC3(2, 5, 2), DEC3(2, 5, 3), 
+  DEC3(2, 5, 4), DEC3(2, 5, 5)
+};
+
+/// writes the digits of a channel value to buf 
+/// and returns where the next char goes
+static inline char *put_channel(char *buf, int value) {
+  int skip = short_escapes ? (value < 10) + (value < 100) : 0;
+  memcpy(buf, &channel_digits[value][skip], 3 - skip);
+  return buf + 3 - skip;
+}
+
+/// appends the escape sequence for the given background color
+/// (\x1b[48;2;RRR;GGG;BBBm) to buf and returns its length,
+/// with layer '3' instead of '4' it sets the foreground color
+static inline int put_color_esc(char *buf, char layer, int r, int g, int b) {
+  char *p = buf;
+  memcpy(p, "\x1b[48;2;", 7);
+  p[2] = layer;
+  p = put_channel(p + 7, r);
+  *p++ = ';';
+  p = put_channel(p, g);
+  *p++ = ';';
+  p = put_channel(p, b);
+  *p++ = 'm';
+  return p - buf;
+}
+
+/// writes the whole buffer to the given file descriptor
+/// (retries on partial writes)
+int write_all(int fd, const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t written = write(fd, buf, len);
+    if (written == -1) {
+      if (errno == EINTR || errno == EAGAIN) {
+        continue;
+      }
+      return ERROR;
+    }
+    buf += written;
+    len -= written;
+  }
+  return SUCCESS;
+}
+
+/// makes room for len more bytes
+static void ab_reserve(struct abuf *ab, int len) {
+  if (ab->len + len > ab->cap) {
+    int cap = MAX(ab->cap * 2, ab->len + len);
+    char *b = realloc(ab->b, cap);
+    if (!b) {
+      die("realloc");
+    }
+    ab->b = b;
+    ab->cap = cap;
+  }
+}
+
+void ab_append(struct abuf *ab, const char *s, int len) {
+  ab_reserve(ab, len);
+  memcpy(&ab->b[ab->len], s, len);
+  ab->len += len;
+}
+
+/// appends s count times, the copies double each step
+void ab_append_repeat(struct abuf *ab, const char *s, int len, int count) {
+  if (count <= 0) {
+    return;
+  }
+  int total = len * count;
+  ab_reserve(ab, total);
+  char *start = &ab->b[ab->len];
+  memcpy(start, s, len);
+  for (int done = len; done < total; done *= 2) {
+    memcpy(&start[done], start, MIN(done, total - done));
+  }
+  ab->len += total;
+}
+
+/// makes sure the frame buffers fit the current terminal size
+///
+/// if they have to be recreated the front buffer is marked unknown
+/// so the next frame redraws everything
+void resize_frame() {
+  if (frame.rows == term.rows && frame.cols == term.cols && frame.back) {
+    return;
+  }
+  size_t cellc = (size_t)MAX(term.rows, 0) * MAX(term.cols, 0);
+  frame.rows = term.rows;
+  frame.cols = term.cols;
+  frame.front = realloc(frame.front, MAX(cellc, 1) * sizeof(uint32_t));
+  frame.back = realloc(frame.back, MAX(cellc, 1) * sizeof(uint32_t));
+  if (!frame.front || !frame.back) {
+    die("realloc");
+  }
+  for (size_t i = 0; i < cellc; i++) {
+    frame.front[i] = CELL_UNKNOWN;
+  }
+}
+
+/// forces the next frame to redraw every cell
+void invalidate_frame() {
+  resize_frame();
+  for (size_t i = 0; i < (size_t)frame.rows * frame.cols; i++) {
+    frame.front[i] = CELL_UNKNOWN;
+  }
+  frame.cursor_row = -1;
+  frame.status[0] = '\0';
+  // nothing is known that could be scrolled
+  frame.y_offset = pixels_to_cells(y_offset);
+  frame.x_offset = pixels_to_cells(x_offset);
+}
+
+/// returns the color the given image pixel is shown with,
+/// (semi) transparent pixels are blended with the checkerboard
+static inline uint32_t get_cell_color(int row, int col) {
+  const unsigned char *px = get_pixel(&image, row, col);
+  int a = px[ALPHA_OFFSET];
+  if (a == 255) {
+    return CELL_RGB(px[RED_OFFSET], px[GREEN_OFFSET], px[BLUE_OFFSET]);
+  }
+  const int *bg = ((row >> CHECKER_SHIFT) ^ (col >> CHECKER_SHIFT)) & 1 
+    ? checker_color : transparency_color;
+  if (a == 0) {
+    return CELL_RGB(bg[0], bg[1], bg[2]);
+  }
+  return CELL_RGB(div255(px[RED_OFFSET] * a + bg[0] * (255 - a)),
+      div255(px[GREEN_OFFSET] * a + bg[1] * (255 - a)),
+      div255(px[BLUE_OFFSET] * a + bg[2] * (255 - a)));
+}
+
+/// returns the width or height of the given mip level
+static inline int mip_size(int size, int level) {
+  return (size + (1 << level) - 1) >> level;
+}
+
+/// returns the color of a cell of a mip level (level 0 is the image)
+static inline uint32_t mip_get(int level, int row, int col) {
+  if (level == 0) {
+    return get_cell_color(row, col);
+  }
+  return mip.levels[level][(size_t)row * mip_size(image.width, level) + col];
+}
+
+/// recomputes the cells row_from..row_to x col_from..col_to 
+/// (inclusive) of a level as the average of the 2x2 cells below
+static void mip_update_rect(int level, int row_from, int col_from, 
+    int row_to, int col_to) 
+{
+  int width = mip_size(image.width, level);
+  int below_w = mip_size(image.width, level - 1);
+  int below_h = mip_size(image.height, level - 1);
+  uint32_t *cells = mip.levels[level];
+
+  for (int row = row_from; row <= row_to; row++) {
+    for (int col = col_from; col <= col_to; col++) {
+      int r = 0;
+      int g = 0;
+      int b = 0;
+      int n = 0;
+      for (int y = 2 * row; y <= 2 * row + 1 && y < below_h; y++) {
+        for (int x = 2 * col; x <= 2 * col + 1 && x < below_w; x++) {
+          uint32_t cell = mip_get(level - 1, y, x);
+          r += CELL_R(cell);
+          g += CELL_G(cell);
+          b += CELL_B(cell);
+          n++;
+        }
+      }
+      cells[(size_t)row * width + col] = CELL_RGB(r / n, g / n, b / n);
+    }
+  }
+}
+
+/// makes sure the mip levels up to the given one exist and are 
+/// up to date, only the dirty tiles of built levels are recomputed
+void mip_prepare(int level) {
+  if (mip.built == 0) {
+    mip.tile_rows = mip_size(image.height, MIP_TILE_SHIFT);
+    mip.tile_cols = mip_size(image.width, MIP_TILE_SHIFT);
+    mip.dirty = calloc((size_t)mip.tile_rows * mip.tile_cols, 1);
+    if (!mip.dirty) {
+      die("calloc");
+    }
+  }
+
+  if (mip.any_dirty) {
+    for (int t_row = 0; t_row < mip.tile_rows; t_row++) {
+      for (int t_col = 0; t_col < mip.tile_cols; t_col++) {
+        unsigned char *dirty = &mip.dirty[t_row * mip.tile_cols + t_col];
+        if (!*dirty) {
+          continue;
+        }
+        *dirty = 0;
+
+        // the tile covers fewer cells on every level
+        int row_from = t_row << MIP_TILE_SHIFT;
+        int col_from = t_col << MIP_TILE_SHIFT;
+        int row_to = MIN(row_from + (1 << MIP_TILE_SHIFT), 
+            (int)image.height) - 1;
+        int col_to = MIN(col_from + (1 << MIP_TILE_SHIFT), 
+            (int)image.width) - 1;
+        for (int k = 1; k <= mip.built; k++) {
+          mip_update_rect(k, row_from >> k, col_from >> k, 
+              row_to >> k, col_to >> k);
+        }
+      }
+    }
+    mip.any_dirty = 0;
+  }
+
+  for (int k = mip.built + 1; k <= level; k++) {
+    int width = mip_size(image.width, k);
+    int height = mip_size(image.height, k);
+    mip.levels[k] = malloc((size_t)width * height * sizeof(uint32_t));
+    if (!mip.levels[k]) {
+      die("malloc");
+    }
+    mip_update_rect(k, 0, 0, height - 1, width - 1);
+    mip.built = k;
+  }
+}
+
+/// returns how many rows of cells the image needs from y_offset on
+static inline int view_rows() {
+  int pixels = (int)image.height - y_offset;
+  return zoom < 0 ? mip_size(pixels, -zoom) : pixels << zoom;
+}
+
+/// returns how many columns of cells the image needs from x_offset on
+static inline int view_cols() {
+  int pixels = (int)image.width - x_offset;
+  return zoom < 0 ? mip_size(pixels, -zoom) : pixels << zoom;
+}
+
+/// returns the image row the cursor is on
+static inline int cursor_image_row() {
+  return y_offset + cells_to_pixels(y_cursor);
+}
+
+/// returns the image column the cursor is on
+static inline int cursor_image_col() {
+  return x_offset + cells_to_pixels(x_cursor);
+}
+
+/// returns the color of the cell at the given screen position
+/// (the cell has to show a part of the image)
+static inline uint32_t get_view_color(int row, int col) {
+  if (zoom < 0) {
+    return mip_get(-zoom, (y_offset >> -zoom) + row, 
+        (x_offset >> -zoom) + col);
+  }
+  return get_cell_color(y_offset + (row >> zoom), x_offset + (col >> zoom));
+}
+
+/// returns the first char of the given terminal line from col on 
+/// which has to be redrawn or frame.cols if there is none
+static inline int next_changed_char(int line, int col) {
+  int per_line = cells_per_line();
+  int next = frame.cols;
+  for (int r = line * per_line; r < (line + 1) * per_line; r++) {
+    size_t i = (size_t)r * frame.cols + col;
+    next = MIN(next, col + (int)kernels->same_cells(&frame.back[i], 
+          &frame.front[i], next - col));
+  }
+  return next;
+}
+
+/// appends the cells from..to (exclusive) of the given screen row 
+/// in the back buffer to the frame and coalesces equal colors
+///
+/// *color holds the currently active background color
+static void append_cells(int row, int from, int to, uint32_t *color) {
+  char esc[BYTES_PER_CHAR];
+  uint32_t *cells = &frame.back[(size_t)row * frame.cols];
+
+  int i = from;
+  while (i < to) {
+    // find the run of cells sharing this color
+    int run_end = i + kernels->cell_run(&cells[i], cells[i], to - i);
+
+    if (cells[i] != *color) {
+      if (cells[i] == CELL_EMPTY) {
+        ab_append(&frame.out, "\x1b[49m", 5);
+      }
+      else {
+        int len = put_color_esc(esc, '4', CELL_R(cells[i]), 
+            CELL_G(cells[i]), CELL_B(cells[i]));
+        ab_append(&frame.out, esc, len);
+      }
+      *color = cells[i];
+    }
+
+    if (cells[i] == CELL_EMPTY && run_end == frame.cols) {
+      // clearing is cheaper than spaces till the end of the line
+      ab_append(&frame.out, "\x1b[K", 3);
+    }
+    else {
+      // every pixel is two chars wide
+      ab_append_repeat(&frame.out, "  ", 2, run_end - i);
+    }
+    i = run_end;
+  }
+}
+
+/// appends the escape sequence for a color of the given layer 
+/// ('3' foreground, '4' background) unless it is already active
+static inline void append_layer_color(char layer, uint32_t cell, 
+    uint32_t *current) 
+{
+  if (cell == *current) {
+    return;
+  }
+  if (cell == CELL_EMPTY) {
+    char esc[] = { '\x1b', '[', layer, '9', 'm' };
+    ab_append(&frame.out, esc, sizeof(esc));
+  }
+  else {
+    char esc[BYTES_PER_CHAR];
+    int len = put_color_esc(esc, layer, 
+        CELL_R(cell), CELL_G(cell), CELL_B(cell));
+    ab_append(&frame.out, esc, len);
+  }
+  *current = cell;
+}
+
+/// appends the chars from..to (exclusive) of the given terminal line 
+/// in half block mode, every char shows the cells of two rows
+///
+/// *bg and *fg hold the currently active colors
+static void append_half_cells(int line, int from, int to, 
+    uint32_t *bg, uint32_t *fg) 
+{
+  uint32_t *top = &frame.back[(size_t)2 * line * frame.cols];
+  uint32_t *bottom = top + frame.cols;
+
+  int i = from;
+  while (i < to) {
+    // find the run of chars sharing both colors
+    int run = kernels->cell_run(&top[i], top[i], to - i);
+    int run_end = i + kernels->cell_run(&bottom[i], bottom[i], run);
+
+    const char *glyph = UPPER_HALF_BLOCK;
+    int glyph_len = sizeof(UPPER_HALF_BLOCK) - 1;
+    if (top[i] == bottom[i]) {
+      // a space only needs the background
+      append_layer_color('4', top[i], bg);
+      glyph = " ";
+      glyph_len = 1;
+    }
+    else if (top[i] == CELL_EMPTY) {
+      // the default background can't be a foreground color
+      append_layer_color('4', CELL_EMPTY, bg);
+      append_layer_color('3', bottom[i], fg);
+      glyph = LOWER_HALF_BLOCK;
+      glyph_len = sizeof(LOWER_HALF_BLOCK) - 1;
+    }
+    else {
+      append_layer_color('4', bottom[i], bg);
+      append_layer_color('3', top[i], fg);
+    }
+
+    if (top[i] == CELL_EMPTY && bottom[i] == CELL_EMPTY 
+      && run_end == frame.cols) 
+    {
+      // clearing is cheaper than spaces till the end of the line
+      ab_append(&frame.out, "\x1b[K", 3);
+    }
+    else {
+      ab_append_repeat(&frame.out, glyph, glyph_len, run_end - i);
+    }
+    i = run_end;
+  }
+}
+
+/// lets the terminal shift its content if the offsets changed
+/// since the last frame and shifts the front buffer accordingly
+///
+/// rows are scrolled with SU/SD and columns with DCH/ICH, 
+/// so only the newly visible cells have to be sent afterwards
+///
+/// returns 1 if anything was scrolled
+static int scroll_frame() {
+  int dy = pixels_to_cells(y_offset) - frame.y_offset;
+  int dx = pixels_to_cells(x_offset) - frame.x_offset;
+  frame.y_offset = pixels_to_cells(y_offset);
+  frame.x_offset = pixels_to_cells(x_offset);
+
+  // in half block mode only whole lines (two rows) can be scrolled,
+  // the cells of odd scrolls are redrawn instead
+  if (dy % cells_per_line() != 0) {
+    dy = 0;
+  }
+  if ((dy == 0 && dx == 0) || abs(dy) >= frame.rows || abs(dx) >= frame.cols) {
+    return 0;
+  }
+
+  char buf[32];
+  int len;
+  // scrolled or inserted cells use the default background
+  ab_append(&frame.out, "\x1b[0m", 4);
+
+  if (dy != 0) {
+    // scroll up (S) if the offset grew, else scroll down (T)
+    // (limited to the image rows so the status line stays)
+    len = sprintf(buf, "\x1b[1;%dr\x1b[%d%c\x1b[r", 
+        term.lines, abs(dy) / cells_per_line(), dy > 0 ? 'S' : 'T');
+    ab_append(&frame.out, buf, len);
+
+    size_t moved = (size_t)(frame.rows - abs(dy)) * frame.cols;
+    if (dy > 0) {
+      memmove(frame.front, &frame.front[(size_t)dy * frame.cols], 
+          moved * sizeof(uint32_t));
+    }
+    else {
+      memmove(&frame.front[(size_t)-dy * frame.cols], frame.front, 
+          moved * sizeof(uint32_t));
+    }
+    // the new rows are empty
+    size_t start = dy > 0 ? moved : 0;
+    for (size_t i = 0; i < (size_t)abs(dy) * frame.cols; i++) {
+      frame.front[start + i] = CELL_EMPTY;
+    }
+  }
+
+  if (dx != 0) {
+    int per_line = cells_per_line();
+    for (int line = 0; line < term.lines; line++) {
+      uint32_t *rows = &frame.front[(size_t)line * per_line * frame.cols];
+
+      // nothing to shift in empty lines
+      int empty = 1;
+      for (int c = 0; c < per_line * frame.cols && empty; c++) {
+        empty = rows[c] == CELL_EMPTY;
+      }
+      if (empty) {
+        continue;
+      }
+
+      // delete (P) chars at the start of the line to shift it left
+      // or insert (@) chars to shift it right
+      len = sprintf(buf, "\x1b[%d;1H\x1b[%d%c", 
+          line + 1, chars_per_cell() * abs(dx), dx > 0 ? 'P' : '@');
+      ab_append(&frame.out, buf, len);
+
+      int moved = frame.cols - abs(dx);
+      for (int r = 0; r < per_line; r++) {
+        uint32_t *front = &rows[(size_t)r * frame.cols];
+        if (dx > 0) {
+          memmove(front, &front[dx], moved * sizeof(uint32_t));
+          for (int c = moved; c < frame.cols; c++) {
+            front[c] = CELL_EMPTY;
+          }
+        }
+        else {
+          memmove(&front[-dx], front, moved * sizeof(uint32_t));
+          for (int c = 0; c < -dx; c++) {
+            front[c] = CELL_EMPTY;
+          }
+        }
+      }
+    }
+  }
+  return 1;
+}
+
+/// sets the message of the status line
+/// (it is shown with the next frame)
+void set_status(const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(status_msg, STATUS_MAX, fmt, args);
+  va_end(args);
+}
+
+/// keeps the cursor on the visible part of the image
+///
+/// zoomed in the cursor stays on the first cell of a pixel
+void clamp_cursor() {
+  int max_row = MIN(term.rows, view_rows()) - 1;
+  int max_col = MIN(term.cols, view_cols()) - 1;
+  y_cursor = MAX(MIN(y_cursor, max_row), 0);
+  x_cursor = MAX(MIN(x_cursor, max_col), 0);
+  if (zoom > 0) {
+    y_cursor = pixels_to_cells(cells_to_pixels(y_cursor));
+    x_cursor = pixels_to_cells(cells_to_pixels(x_cursor));
+  }
+}
+
+/// draws the visible part of the image to the screen
+///
+/// only cells which changed since the last frame are sent
+/// and the whole frame is written with a single write
+void render_frame() {
+  if (batch_mode) {
+    return;
+  }
+  if (defer_render) {
+    render_pending = 1;
+    return;
+  }
+  render_pending = 0;
+  resize_frame();
+  update_composite();
+
+  // build the back buffer from the image
+  if (zoom < 0) {
+    mip_prepare(-zoom);
+  }
+  int rows = view_rows();
+  int cols = view_cols();
+  for (int r = 0; r < frame.rows; r++) {
+    uint32_t *cells = &frame.back[(size_t)r * frame.cols];
+    for (int c = 0; c < frame.cols; c++) {
+      if (r < rows && c < cols) {
+        cells[c] = get_view_color(r, c);
+      }
+      else {
+        cells[c] = CELL_EMPTY;
+      }
+    }
+  }
+
+  frame.out.len = 0;
+  int changed = scroll_frame();
+
+  uint32_t color = CELL_UNKNOWN;
+  uint32_t fg_color = CELL_UNKNOWN;
+  for (int line = 0; line < term.lines; line++) {
+    int c = next_changed_char(line, 0);
+    while (c < frame.cols) {
+      // find the end of the changed region, small gaps of unchanged
+      // chars are redrawn as that is cheaper than moving the cursor
+      int end = c + 1;
+      int next = next_changed_char(line, end);
+      while (next < frame.cols && next - end <= FRAME_GAP_MAX) {
+        end = next + 1;
+        next = next_changed_char(line, end);
+      }
+
+      // move cursor to the first changed char
+      char buf[32];
+      int len = sprintf(buf, "\x1b[%d;%dH", 
+          line + 1, chars_per_cell() * c + 1);
+      ab_append(&frame.out, buf, len);
+
+      if (half_block) {
+        append_half_cells(line, c, end, &color, &fg_color);
+      }
+      else {
+        append_cells(line, c, end, &color);
+      }
+      changed = 1;
+      c = next;
+    }
+  }
+
+  // reset formatting and place the cursor
+  clamp_cursor();
+  ab_append(&frame.out, "\x1b[0m", 4);
+  char buf[32];
+
+  // status line below the image
+  if (strcmp(frame.status, status_msg) != 0) {
+    int len = sprintf(buf, "\x1b[%d;1H\x1b[2K", term.lines + 1);
+    ab_append(&frame.out, buf, len);
+    ab_append(&frame.out, status_msg, 
+        MIN(strlen(status_msg), term.width));
+    strcpy(frame.status, status_msg);
+    changed = 1;
+  }
+
+  int len = sprintf(buf, "\x1b[%d;%dH", 
+      y_cursor / cells_per_line() + 1, chars_per_cell() * x_cursor + 1);
+  ab_append(&frame.out, buf, len);
+
+  if (frame.cursor_row != y_cursor || frame.cursor_col != x_cursor) {
+    changed = 1;
+    frame.cursor_row = y_cursor;
+    frame.cursor_col = x_cursor;
+  }
+
+  // only write if anything changed
+  if (changed) {
+    write_all(frame_fd, frame.out.b, frame.out.len);
+    frame_bytes_written += frame.out.len;
+  }
+
+  uint32_t *tmp = frame.front;
+  frame.front = frame.back;
+  frame.back = tmp;
+}
+
+/// draws the frame if rendering it was deferred
+void flush_render() {
+  if (!render_pending) {
+    return;
+  }
+  int deferred = defer_render;
+  defer_render = 0;
+  render_frame();
+  defer_render = deferred;
+}
+
+/// redraws the whole screen based on the offsets
+void print_screen() {
+  invalidate_frame();
+  render_frame();
+}
+
+void pipette(int row, int col) {
+  update_composite();
+  const unsigned char *px = get_pixel(&image, row, col);
+  r_sel = px[RED_OFFSET];
+  g_sel = px[GREEN_OFFSET];
+  b_sel = px[BLUE_OFFSET];
+  a_sel = px[ALPHA_OFFSET];
+}
+
+/// fills the whole active layer with given color
+///
+/// filling with the transparency color just drops all tiles
+void fill_image(int r, int g, int b, int a) {
+  for (int row = 0; row < image.height; row++) {
+    mark_dirty(row, 0, image.width);
+  }
+  struct canvas *c = active_canvas();
+  // (a full palette may have no entry for transparent pixels)
+  if (a == 0 && (!c->palette || palette_index(c->palette, empty_tile) >= 0)) 
+  {
+    for (size_t i = 0; i < (size_t)c->tile_rows * c->tile_cols; i++) {
+      free(c->tiles[i]);
+      c->tiles[i] = NULL;
+    }
+    return;
+  }
+  for (int row = 0; row < image.height; row++) {
+    fill_span(row, 0, image.width - 1, r, g, b, a);
+  }
+}
+
+/*** history ***/
+
+/// appends the pixels of the given span as runs
+/// and returns how many runs were added
+static int history_append_runs(struct history_runs *runs, 
+    const struct canvas *c, int row, int col, int len) 
+{
+  int runc = 0;
+  for (int i = 0; i < len; i++) {
+    const unsigned char *px = get_pixel(c, row, col + i);
+    if (runc > 0 && memcmp(runs->runs[runs->runc - 1].color, 
+          px, IMAGE_DEPTH) == 0) 
+    {
+      runs->runs[runs->runc - 1].count++;
+      continue;
+    }
+
+    if (runs->runc == runs->cap) {
+      runs->cap = MAX(runs->cap * 2, 16);
+      runs->runs = realloc(runs->runs, runs->cap * sizeof(*runs->runs));
+      if (!runs->runs) {
+        die("realloc");
+      }
+    }
+    runs->runs[runs->runc].count = 1;
+    memcpy(runs->runs[runs->runc].color, px, IMAGE_DEPTH);
+    runs->runc++;
+    runc++;
+  }
+  return runc;
+}
+
+/// starts recording the changes of a command
+void history_begin() {
+  memset(&history_current, 0, sizeof(history_current));
+  history_current.layer = layers.active;
+  history_recording = 1;
+}
+
+/// saves the current pixels of a span before it gets changed
+///
+/// spans of one command must not overlap
+void history_record(int row, int col, int len) {
+  if (!history_recording || len <= 0) {
+    return;
+  }
+
+  struct history_entry *e = &history_current;
+  if (e->spanc == e->span_cap) {
+    e->span_cap = MAX(e->span_cap * 2, 16);
+    e->spans = realloc(e->spans, e->span_cap * sizeof(*e->spans));
+    if (!e->spans) {
+      die("realloc");
+    }
+  }
+
+  struct history_span *span = &e->spans[e->spanc++];
+  span->row = row;
+  span->col = col;
+  span->len = len;
+  span->old_runs = history_append_runs(&e->old, layer_canvas(e->layer), 
+      row, col, len);
+  span->new_runs = 0;
+}
+
+static void history_free_entry(struct history_entry *e) {
+  history_bytes -= e->bytes;
+  free(e->spans);
+  free(e->old.runs);
+  free(e->new.runs);
+  memset(e, 0, sizeof(*e));
+}
+
+/// finishes the recording of a command and pushes it onto the stack
+///
+/// the pixels after the command are saved behind the old ones,
+/// the oldest entries are dropped if the budget is exceeded
+void history_commit() {
+  if (!history_recording) {
+    return;
+  }
+  history_recording = 0;
+
+  struct history_entry e = history_current;
+  if (e.spanc == 0) {
+    return;
+  }
+
+  for (int i = 0; i < e.spanc; i++) {
+    struct history_span *span = &e.spans[i];
+    span->new_runs = history_append_runs(&e.new, layer_canvas(e.layer),
+        span->row, span->col, span->len);
+  }
+
+  e.bytes = sizeof(e) + e.spanc * sizeof(*e.spans) 
+    + (e.old.runc + e.new.runc) * sizeof(struct history_run);
+
+  // everything that could be redone is lost now
+  for (int i = history_pos; i < history_len; i++) {
+    history_free_entry(&history[i]);
+  }
+  history_len = history_pos;
+
+  if (e.bytes > history_budget) {
+    free(e.spans);
+    free(e.old.runs);
+    free(e.new.runs);
+    return;
+  }
+
+  // drop the oldest entries until the new one fits
+  int dropped = 0;
+  while (dropped < history_len 
+      && history_bytes + e.bytes > history_budget) 
+  {
+    history_free_entry(&history[dropped]);
+    dropped++;
+  }
+  if (dropped > 0) {
+    memmove(history, &history[dropped], 
+        (history_len - dropped) * sizeof(*history));
+    history_len -= dropped;
+  }
+
+  if (history_len == history_cap) {
+    history_cap = MAX(history_cap * 2, 16);
+    history = realloc(history, history_cap * sizeof(*history));
+    if (!history) {
+      die("realloc");
+    }
+  }
+  history[history_len++] = e;
+  history_pos = history_len;
+  history_bytes += e.bytes;
+}
+
+/// writes the old (undo) or new (redo) pixels of an entry to its layer
+static void history_apply(struct history_entry *e, int undo) {
+  struct history_run *run = undo ? e->old.runs : e->new.runs;
+  struct canvas *c = layer_canvas(e->layer);
+  for (int i = 0; i < e->spanc; i++) {
+    struct history_span *span = &e->spans[i];
+    int col = span->col;
+    int runc = undo ? span->old_runs : span->new_runs;
+    mark_dirty(span->row, span->col, span->len);
+    for (int j = 0; j < runc; j++, run++) {
+      for (uint32_t k = 0; k < run->count; k++) {
+        put_pixel(c, span->row, col++, run->color);
+      }
+    }
+  }
+}
+
+/// keeps the layers of the entries in line with the stack after a
+/// layer was inserted (added 1) or removed (added -1) at inx,
+/// the changes of a removed layer are dropped
+void history_move_layers(int inx, int added) {
+  int kept = 0;
+  int pos = history_pos;
+  for (int i = 0; i < history_len; i++) {
+    struct history_entry *e = &history[i];
+    if (added < 0 && e->layer == inx) {
+      if (i < history_pos) {
+        pos--;
+      }
+      history_free_entry(e);
+      continue;
+    }
+    if (e->layer >= inx + (added < 0)) {
+      e->layer += added;
+    }
+    history[kept++] = *e;
+  }
+  history_len = kept;
+  history_pos = pos;
+}
+
+/// reverts the last command and redraws the affected lines
+void undo() {
+  if (history_pos == 0) {
+    return;
+  }
+  history_pos--;
+  history_apply(&history[history_pos], 1);
+  render_frame();
+}
+
+/// applies the last reverted command again
+void redo() {
+  if (history_pos == history_len) {
+    return;
+  }
+  history_apply(&history[history_pos], 0);
+  history_pos++;
+  render_frame();
+}
+
+/*** editing ***/
+
+/// adds an empty layer above the active one and makes it active
+///
+/// returns ERROR if there are LAYERS_MAX layers already
+int add_layer() {
+  struct canvas c;
+  if (layers.count == LAYERS_MAX 
+    || init_canvas(&c, image.width, image.height) == ERROR) 
+  {
+    return ERROR;
+  }
+  separate_layers();
+
+  // an empty layer doesn't change the composite
+  int inx = layers.active + 1;
+  memmove(&layers.items[inx + 1], &layers.items[inx], 
+      (layers.count - inx) * sizeof(*layers.items));
+  layers.items[inx].canvas = c;
+  layers.items[inx].visible = 1;
+  layers.items[inx].opacity = 255;
+  layers.items[inx].blend = BLEND_NORMAL;
+  layers.count++;
+  layers.active = inx;
+  history_move_layers(inx, 1);
+  return SUCCESS;
+}
+
+/// deletes the active layer, the one below it becomes active
+///
+/// returns ERROR if it is the only layer
+int delete_layer() {
+  if (layers.count == 1) {
+    return ERROR;
+  }
+  int inx = layers.active;
+  mark_layer_dirty(inx);
+  free_canvas(&layers.items[inx].canvas);
+  memmove(&layers.items[inx], &layers.items[inx + 1], 
+      (layers.count - inx - 1) * sizeof(*layers.items));
+  layers.count--;
+  memset(&layers.items[layers.count], 0, sizeof(*layers.items));
+  layers.active = MAX(inx - 1, 0);
+  history_move_layers(inx, -1);
+  return SUCCESS;
+}
+
+/// sets the palette entry of the given pixel of the active layer to
+/// the given color, every pixel with that entry changes at once
+///
+/// returns the entry or ERROR if the layer isn't indexed or 
+/// the pixel is in a missing tile (which has no entry)
+int recolor_entry(int row, int col, int r, int g, int b, int a) {
+  struct canvas *c = active_canvas();
+  if (!c->palette || row < 0 || col < 0 
+    || row >= image.height || col >= image.width) 
+  {
+    return ERROR;
+  }
+  const unsigned char *tile = *get_tile(c, row, col);
+  if (!tile) {
+    return ERROR;
+  }
+  int inx = tile[get_pos(row, col)];
+  // missing tiles are transparent too, they get the entry 
+  // before it changes so the whole background follows
+  if (c->palette->colors[inx][ALPHA_OFFSET] == 0) {
+    for (size_t i = 0; i < (size_t)c->tile_rows * c->tile_cols; i++) {
+      if (!c->tiles[i]) {
+        c->tiles[i] = alloc_index_tile(inx);
+      }
+    }
+  }
+  make_pixel(r, g, b, a, c->palette->colors[inx]);
+  // the entry can be anywhere in the layer
+  mark_layer_dirty(layers.active);
+  return inx;
+}
+
+/// fills a pixel with the given color 
+/// and redraws the affected line
+///
+/// index shall be absolute to the image coordinates
+void fill_pixel(int row, int col, int r, int g, int b, int a) {
+  // abort if not in image
+  if (row >= image.height || col >= image.width) {
+    return;
+  }
+  history_begin();
+  history_record(row, col, 1);
+  mark_dirty(row, col, 1);
+  set_pixel(r, g, b, a, row, col);
+  history_commit();
+
+  render_frame();
+}
+
+/// fills a range of pixels with the given color 
+/// and redraws affected lines
+///
+/// index shall be absolute to the image coordinates
+void fill_selection(int from_r, int from_c, 
+    int to_r, int to_c,
+    int r, int g, int b, int a) {
+  // abort if not in image
+  if (from_r >= image.height || from_c >= image.width ||
+    to_r >= image.height || to_c >= image.width) {
+    return;
+  }
+
+  int start_col = MIN(from_c, to_c);
+  int end_col = MAX(from_c, to_c);
+  int start_row = MIN(from_r, to_r);
+  int end_row = MAX(from_r, to_r);
+
+  history_begin();
+  for (int row = start_row; row <= end_row; row++) {
+    history_record(row, start_col, end_col - start_col + 1);
+    mark_dirty(row, start_col, end_col - start_col + 1);
+    fill_span(row, start_col, end_col, r, g, b, a);
+  }
+  history_commit();
+
+  render_frame();
+}
+
+/// copies the pixels of a rectangle (corners inclusive, in any order)
+/// of the active layer to the clipboard, it is clipped to the image
+///
+/// returns ERROR if none of it is inside the image
+int yank(int from_r, int from_c, int to_r, int to_c) {
+  int start_row = MAX(MIN(from_r, to_r), 0);
+  int start_col = MAX(MIN(from_c, to_c), 0);
+  int end_row = MIN(MAX(from_r, to_r), (int)image.height - 1);
+  int end_col = MIN(MAX(from_c, to_c), (int)image.width - 1);
+  if (start_row > end_row || start_col > end_col) {
+    return ERROR;
+  }
+
+  int w = end_col - start_col + 1;
+  int h = end_row - start_row + 1;
+  unsigned char *pixels = realloc(clipboard.pixels, 
+      (size_t)w * h * IMAGE_DEPTH);
+  if (!pixels) {
+    die("realloc");
+  }
+  clipboard.pixels = pixels;
+  clipboard.width = w;
+  clipboard.height = h;
+  for (int r = 0; r < h; r++) {
+    read_span(active_canvas(), start_row + r, start_col, w, 
+        &pixels[(size_t)r * w * IMAGE_DEPTH]);
+  }
+  return SUCCESS;
+}
+
+/// draws a w x h block of rgba pixels (rows are stride pixels apart)
+/// onto a canvas with its top left pixel at row, col, the parts of 
+/// it outside of the canvas are clipped
+///
+/// every row is copied with a memcpy per tile, with the flag
+/// BLIT_SKIP_TRANSPARENT only the runs of pixels which aren't
+/// transparent are copied
+///
+/// the rows are marked dirty but not recorded in the history
+void blit(struct canvas *c, int row, int col, const unsigned char *src, 
+    int w, int h, int stride, int flags)
+{
+  int start_row = MAX(row, 0);
+  int start_col = MAX(col, 0);
+  int end_row = MIN(row + h, (int)c->height);
+  int end_col = MIN(col + w, (int)c->width);
+  if (start_row >= end_row || start_col >= end_col) {
+    return;
+  }
+  int len = end_col - start_col;
+  unsigned char key[IMAGE_DEPTH];
+  make_pixel(0, 0, 0, 0, key);
+
+  for (int r = start_row; r < end_row; r++) {
+    const unsigned char *px = &src[((size_t)(r - row) * stride 
+        + (start_col - col)) * IMAGE_DEPTH];
+    mark_dirty(r, start_col, len);
+    if (!(flags & BLIT_SKIP_TRANSPARENT)) {
+      write_span(c, r, start_col, len, px);
+      continue;
+    }
+    for (int i = 0; i < len; ) {
+      // transparent pixels are all the same (see make_pixel)
+      i += kernels->color_run(&px[(size_t)i * IMAGE_DEPTH], key, len - i);
+      int from = i;
+      while (i < len && px[(size_t)i * IMAGE_DEPTH + ALPHA_OFFSET] != 0) {
+        i++;
+      }
+      write_span(c, r, start_col + from, i - from, 
+          &px[(size_t)from * IMAGE_DEPTH]);
+    }
+  }
+}
+
+/// draws the clipboard onto the active layer with its top left 
+/// pixel at the given one and redraws
+void paste(int row, int col) {
+  if (!clipboard.pixels) {
+    return;
+  }
+  int start_col = MAX(col, 0);
+  int len = MIN(col + clipboard.width, (int)image.width) - start_col;
+
+  history_begin();
+  for (int r = MAX(row, 0); 
+      r < MIN(row + clipboard.height, (int)image.height); r++) 
+  {
+    history_record(r, start_col, len);
+  }
+  blit(active_canvas(), row, col, clipboard.pixels, 
+      clipboard.width, clipboard.height, clipboard.width, 
+      paste_skip_transparent ? BLIT_SKIP_TRANSPARENT : 0);
+  history_commit();
+
+  render_frame();
+}
+
+/// moves the pixels of a rectangle (corners inclusive, in any order) 
+/// of the active layer so its top left pixel is at the given one,
+/// the pixels it leaves become transparent
+///
+/// the pixels are copied to the clipboard as well, the move is 
+/// one step in the history
+void move_selection(int from_r, int from_c, int to_r, int to_c, 
+    int row, int col) 
+{
+  if (yank(from_r, from_c, to_r, to_c) == ERROR) {
+    return;
+  }
+  int src_row = MAX(MIN(from_r, to_r), 0);
+  int src_col = MAX(MIN(from_c, to_c), 0);
+  int w = clipboard.width;
+  int h = clipboard.height;
+
+  // the rows of the source and the destination overlap, every row
+  // is recorded once with the columns of both
+  history_begin();
+  for (int r = MIN(src_row, row); r < MAX(src_row + h, row + h); r++) {
+    if (r < 0 || r >= image.height) {
+      continue;
+    }
+    int from = INT_MAX;
+    int to = -1;
+    if (r >= src_row && r < src_row + h) {
+      from = src_col;
+      to = src_col + w - 1;
+    }
+    if (r >= row && r < row + h) {
+      from = MIN(from, MAX(col, 0));
+      to = MAX(to, MIN(col + w, (int)image.width) - 1);
+    }
+    if (to >= from) {
+      history_record(r, from, to - from + 1);
+    }
+  }
+  for (int r = src_row; r < src_row + h; r++) {
+    mark_dirty(r, src_col, w);
+    fill_span(r, src_col, src_col + w - 1, 0, 0, 0, 0);
+  }
+  blit(active_canvas(), row, col, clipboard.pixels, w, h, w, 
+      paste_skip_transparent ? BLIT_SKIP_TRANSPARENT : 0);
+  history_commit();
+
+  render_frame();
+}
+
+/// mirrors the clipboard, horizontally (left to right) or vertically
+void flip_clipboard(int horizontal) {
+  if (!clipboard.pixels) {
+    return;
+  }
+  int w = clipboard.width;
+  int h = clipboard.height;
+  unsigned char *px = clipboard.pixels;
+  unsigned char tmp[IMAGE_DEPTH];
+  if (horizontal) {
+    for (int r = 0; r < h; r++) {
+      unsigned char *row = &px[(size_t)r * w * IMAGE_DEPTH];
+      for (int c = 0; c < w / 2; c++) {
+        unsigned char *a = &row[(size_t)c * IMAGE_DEPTH];
+        unsigned char *b = &row[(size_t)(w - 1 - c) * IMAGE_DEPTH];
+        memcpy(tmp, a, IMAGE_DEPTH);
+        memcpy(a, b, IMAGE_DEPTH);
+        memcpy(b, tmp, IMAGE_DEPTH);
+      }
+    }
+    return;
+  }
+  // whole rows are swapped
+  size_t row_bytes = (size_t)w * IMAGE_DEPTH;
+  unsigned char *row = malloc(row_bytes);
+  if (!row) {
+    die("malloc");
+  }
+  for (int r = 0; r < h / 2; r++) {
+    memcpy(row, &px[r * row_bytes], row_bytes);
+    memcpy(&px[r * row_bytes], &px[(h - 1 - r) * row_bytes], row_bytes);
+    memcpy(&px[(h - 1 - r) * row_bytes], row, row_bytes);
+  }
+  free(row);
+}
+
+/// rotates the clipboard by 90 degrees clockwise
+void rotate_clipboard() {
+  if (!clipboard.pixels) {
+    return;
+  }
+  int w = clipboard.width;
+  int h = clipboard.height;
+  unsigned char *rotated = malloc((size_t)w * h * IMAGE_DEPTH);
+  if (!rotated) {
+    die("malloc");
+  }
+  // the first column from the bottom up is the new first row
+  for (int r = 0; r < w; r++) {
+    for (int c = 0; c < h; c++) {
+      memcpy(&rotated[((size_t)r * h + c) * IMAGE_DEPTH], 
+          &clipboard.pixels[((size_t)(h - 1 - c) * w + r) * IMAGE_DEPTH], 
+          IMAGE_DEPTH);
+    }
+  }
+  free(clipboard.pixels);
+  clipboard.pixels = rotated;
+  clipboard.width = h;
+  clipboard.height = w;
+}
+
+/// returns 1 if the pixel is within the tolerance of target
+static inline int fill_matches(const unsigned char *px, 
+    const unsigned char *target) 
+{
+  for (int i = 0; i < IMAGE_DEPTH; i++) {
+    if (abs(px[i] - target[i]) > fill_tolerance) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/// returns 1 if the given pixel should be filled by the bucket fill
+static inline int fill_inside(int row, int col, 
+    const unsigned char *target, const unsigned char *visited) 
+{
+  size_t pos = (size_t)row * image.width + col;
+  if (visited && (visited[pos / 8] & (1 << (pos % 8)))) {
+    return 0;
+  }
+  return fill_matches(get_pixel(active_canvas(), row, col), target);
+}
+
+/// fills the pixels from..to (inclusive) of the given row 
+/// and pushes the span onto the work stack
+static void fill_push_span(int row, int from, int to, 
+    const unsigned char *px, unsigned char *visited, size_t *sp) 
+{
+  history_record(row, from, to - from + 1);
+  mark_dirty(row, from, to - from + 1);
+  fill_span(row, from, to, px[RED_OFFSET], px[GREEN_OFFSET], 
+      px[BLUE_OFFSET], px[ALPHA_OFFSET]);
+  for (int col = from; col <= to && visited; col++) {
+    size_t pos = (size_t)row * image.width + col;
+    visited[pos / 8] |= 1 << (pos % 8);
+  }
+
+  if (*sp == fill_stack_cap) {
+    fill_stack_cap *= 2;
+    fill_stack = realloc(fill_stack, fill_stack_cap * sizeof(*fill_stack));
+    if (!fill_stack) {
+      die("realloc");
+    }
+  }
+  fill_stack[*sp].row = row;
+  fill_stack[*sp].from = from;
+  fill_stack[*sp].to = to;
+  (*sp)++;
+}
+
+/// fills the region of similar color around the given pixel
+/// (bucket fill) and redraws the affected lines
+///
+/// every filled span of a row is pushed onto an explicit stack
+/// and later the rows above and below it are scanned for more
+/// spans, so every pixel is only looked at a few times
+///
+/// index shall be absolute to the image coordinates
+void bucket_fill(int row, int col, int r, int g, int b, int a) {
+  // abort if not in image
+  if (row >= image.height || col >= image.width) {
+    return;
+  }
+
+  unsigned char target[IMAGE_DEPTH];
+  memcpy(target, get_pixel(active_canvas(), row, col), IMAGE_DEPTH);
+
+  // check what the new color looks like in the image
+  unsigned char fill[IMAGE_DEPTH];
+  make_pixel(r, g, b, a, fill);
+  struct palette *palette = active_canvas()->palette;
+  if (palette) {
+    // a full palette stores the closest entry, maybe the target itself
+    memcpy(fill, palette->colors[palette_lookup(palette, fill)], 
+        IMAGE_DEPTH);
+  }
+
+  if (memcmp(fill, target, IMAGE_DEPTH) == 0) {
+    return;
+  }
+
+  // filled pixels which still match the target have to be remembered
+  // or they would be filled again and again
+  unsigned char *visited = NULL;
+  if (fill_matches(fill, target)) {
+    visited = calloc(((size_t)image.width * image.height + 7) / 8, 1);
+    if (!visited) {
+      die("calloc");
+    }
+  }
+
+  if (!fill_stack) {
+    fill_stack_cap = 2 * (image.width + image.height);
+    fill_stack = malloc(fill_stack_cap * sizeof(*fill_stack));
+    if (!fill_stack) {
+      die("malloc");
+    }
+  }
+
+  // diagonal neighbours count for 8-connectivity
+  int diag = fill_connectivity == 8 ? 1 : 0;
+
+  // fill the span around the seed
+  int from = col;
+  int to = col;
+  while (from > 0 && fill_inside(row, from - 1, target, visited)) {
+    from--;
+  }
+  while (to < image.width - 1 && fill_inside(row, to + 1, target, visited)) {
+    to++;
+  }
+  size_t sp = 0;
+  history_begin();
+  fill_push_span(row, from, to, fill, visited, &sp);
+
+  while (sp > 0) {
+    struct fill_span span = fill_stack[--sp];
+
+    // look for spans in the row above and below
+    for (int dir = -1; dir <= 1; dir += 2) {
+      int next = span.row + dir;
+      if (next < 0 || next >= image.height) {
+        continue;
+      }
+
+      int c = MAX(span.from - diag, 0);
+      int end = MIN(span.to + diag, (int)image.width - 1);
+      while (c <= end) {
+        if (!fill_inside(next, c, target, visited)) {
+          c++;
+          continue;
+        }
+
+        // expand the found span in both directions
+        from = c;
+        to = c;
+        while (from > 0 && fill_inside(next, from - 1, target, visited)) {
+          from--;
+        }
+        while (to < image.width - 1 
+            && fill_inside(next, to + 1, target, visited)) 
+        {
+          to++;
+        }
+        fill_push_span(next, from, to, fill, visited, &sp);
+        c = to + 2;
+      }
+    }
+  }
+
+  history_commit();
+  free(visited);
+  render_frame();
+}
+
+void clear_screen() {
+  // clear screen
+  write(STDOUT_FILENO, "\x1b[2J", 4);
+  // move cursor to beginning
+  write(STDOUT_FILENO, "\x1b[H", 3);
+
+  // the terminal is empty now
+  resize_frame();
+  for (size_t i = 0; i < (size_t)frame.rows * frame.cols; i++) {
+    frame.front[i] = CELL_EMPTY;
+  }
+  frame.cursor_row = -1;
+  frame.status[0] = '\0';
+}
+
+int save_pipette_color(char c) {
+  if (c < ASCII_NUMBERS_START || c > ASCII_NUMBERS_START + 9) {
+    return ERROR;
+  }
+
+  color_palette[c - ASCII_NUMBERS_START][0] = r_sel;
+  color_palette[c - ASCII_NUMBERS_START][1] = g_sel;
+  color_palette[c - ASCII_NUMBERS_START][2] = b_sel;
+
+  return SUCCESS;
+}
+
+/// compares the two pixels at the given columns of a row
+///
+/// returns 1 if they are different, 0 if they are the same 
+/// and -1 if there was an error
+int cmp_pixel_color(int row, int col1, int col2) {
+  if (!image.tiles) {
+    return -1;
+  }
+
+  const unsigned char *px1 = get_pixel(&image, row, col1);
+  const unsigned char *px2 = get_pixel(&image, row, col2);
+  if (memcmp(px1, px2, IMAGE_DEPTH) == 0) {
+    return 0;
   }
 
   return 1;
 }
 
-/// jumps to the next color in the line where the cursor is
-/// if dir is 1 it will search to the right of the cursor
-/// if dir is -1 it will search to the left of the cursor
-/// after the cursor is moved it moves the offsets if it is
-/// now offscreen and redraws the screen
-void jmp_next_color(int cursor_row, int cursor_col, int dir) {
-  int diff; // specifies the maximum amount of pixels to jump
-  char command;
-  int index = get_inx(cursor_row, cursor_col);
-  int origin_pixel = index;
-  int move_by = -1;
-  int back_color_found = -1;
+/// counts the pixels of a row from col on in the given direction
+/// which have the color of ref, at most n
+static int row_color_run(int row, int col, int n, int dir, 
+    const unsigned char *ref) 
+{
+  int count = 0;
+  if (image.palette) {
+    // the pixels are looked up one by one
+    while (count < n && memcmp(get_pixel(&image, row, col + dir * count), 
+          ref, IMAGE_DEPTH) == 0) 
+    {
+      count++;
+    }
+    return count;
+  }
+  while (count < n) {
+    // the rest of the tile in this direction
+    int c = col + dir * count;
+    int in_tile = dir > 0 
+      ? TILE_SIZE - (c & (TILE_SIZE - 1)) : (c & (TILE_SIZE - 1)) + 1;
+    int len = MIN(n - count, in_tile);
+    const unsigned char *px = get_pixel(&image, row, c);
+    int same = dir > 0 ? kernels->color_run(px, ref, len) 
+      : kernels->color_run_rev(px, ref, len);
+    count += same;
+    if (same < len) {
+      break;
+    }
+  }
+  return count;
+}
+
+/// jumps to the next color in the line where the cursor is
+/// if dir is 1 it will search to the right of the cursor
+/// if dir is -1 it will search to the left of the cursor
+/// after the cursor is moved it moves the offsets if it is
+/// now offscreen and redraws the screen
+///
+/// row and col are image coordinates of the cursor
+void jmp_next_color(int row, int col, int dir) {
+  // jumps between the colors which are shown
+  update_composite();
+  int diff; // specifies the maximum amount of pixels to jump
+  // pixels from the left edge of the screen
+  int cursor_col = col - x_offset;
+  int visible_cols = MIN(cells_to_pixels(term.cols), 
+      (int)image.width - x_offset);
+  int index = col;
+  int origin_pixel = index;
+  int move_by = -1;
+
+  if (row >= image.height || cursor_col >= visible_cols) {
+    return;
+  }
+
+  // direction specific setup
+  if (dir < 0) {
+    // return if in first column
+    if (cursor_col == 0) {
+      return;
+    }
+
+    diff = cursor_col;
+
+    // check if cursor is at beginning of color region
+    // and if so change the color to the adjacent one
+    // so that it later won't stop because it sees a 
+    // different color right away
+    if (cmp_pixel_color(row, index, index - 1) == 1) {
+      origin_pixel = index - 1;
+    }
+  }
+  else {
+    // return if in last column
+    if (cursor_col == visible_cols - 1) { 
+      return; 
+    }
+
+    diff = visible_cols - cursor_col - 1;
+  }
+
+  // search for color change in the given direction
+  int same = row_color_run(row, index + dir, diff, dir, 
+      get_pixel(&image, row, origin_pixel));
+  if (same < diff) {
+    move_by = same + ((dir > 0) ? 1 : 0);
+  }
+
+  // if no color change was found move to beginning/end
+  if (move_by < 0) {
+    move_by = diff;
+  }
+
+  // move by calculated amount in specified direction
+  x_cursor = pixels_to_cells(cursor_col + dir * move_by);
+  render_frame();
+}
+
+/// loads the old text format where every channel is saved
+/// as three ascii digits after a line with the width and height
+static int load_legacy_failsave(const char *data, size_t size) {
+  const char *end = data + size;
+  char *next;
+
+  // get width and height
+  // (the data isn't null terminated so the lines are checked first)
+  const char *first_nl = memchr(data, '\n', size);
+  const char *second_nl = first_nl 
+    ? memchr(first_nl + 1, '\n', end - first_nl - 1) : NULL;
+  if (!second_nl) {
+    return ERROR;
+  }
+  long w = strtol(data, &next, 10);
+  long h = strtol(first_nl + 1, &next, 10);
+  if (w <= 0 || h <= 0) {
+    return ERROR;
+  }
+  const char *digits = second_nl + 1;
+
+  size_t pixelc = (size_t)w * h;
+  if ((size_t)(end - digits) < 3 * IMAGE_DEPTH * pixelc) {
+    return ERROR;
+  }
+
+  alloc_canvas(w, h);
+  for (size_t i = 0; i < pixelc; i++) {
+    int channel[IMAGE_DEPTH];
+    for (int c = 0; c < IMAGE_DEPTH; c++) {
+      channel[c] = (digits[0] - ASCII_NUMBERS_START) * 100
+        + (digits[1] - ASCII_NUMBERS_START) * 10
+        + (digits[2] - ASCII_NUMBERS_START);
+      digits += 3;
+    }
+
+    set_pixel(channel[0], channel[1], channel[2], channel[3], 
+        i / w, i % w);
+  }
+
+  return SUCCESS;
+}
+
+/// reads the binary snapshot format (see struct snapshot_header)
+/// into the empty canvas c, which has to be freed even on errors
+static int read_snapshot(struct canvas *c, const unsigned char *data, 
+    size_t size) 
+{
+  struct snapshot_header header;
+  if (size < sizeof(header)) {
+    return ERROR;
+  }
+  memcpy(&header, data, sizeof(header));
+
+  if (memcmp(header.magic, SNAPSHOT_MAGIC, 4) != 0 
+    || header.version > SNAPSHOT_VERSION 
+    || header.width == 0 || header.height == 0) 
+  {
+    return ERROR;
+  }
+
+  size_t rowbytes = (size_t)header.width * IMAGE_DEPTH;
+  size_t bytec = rowbytes * header.height;
+  const unsigned char *payload = data + sizeof(header);
+  const unsigned char *end = data + size;
+  uLong crc = crc32(0, NULL, 0);
+
+  if (init_canvas(c, header.width, header.height) == ERROR) {
+    return ERROR;
+  }
+
+  if (!(header.flags & SNAPSHOT_COMPRESSED)) {
+    // raw rgba rows
+    if ((size_t)(end - payload) < bytec) {
+      return ERROR;
+    }
+    for (int row = 0; row < header.height; row++) {
+      crc = crc32(crc, payload, rowbytes);
+      write_canvas_row(c, row, payload);
+      payload += rowbytes;
+    }
+  }
+  else {
+    // blocks of SNAPSHOT_BLOCK_ROWS rows with a size prefix each,
+    // every block is unpacked into a buffer and then copied 
+    // into the tiles row by row
+    unsigned char *block = malloc(rowbytes * SNAPSHOT_BLOCK_ROWS);
+    if (!block) {
+      return ERROR;
+    }
+    size_t written = 0;
+    for (uint32_t i = 0; i < header.blockc; i++) {
+      uint32_t sizes[2]; // raw size, compressed size
+      if ((size_t)(end - payload) < sizeof(sizes)) {
+        free(block);
+        return ERROR;
+      }
+      memcpy(sizes, payload, sizeof(sizes));
+      payload += sizeof(sizes);
+
+      uLongf raw_len = sizes[0];
+      if ((size_t)(end - payload) < sizes[1] 
+        || written + raw_len > bytec
+        || raw_len > rowbytes * SNAPSHOT_BLOCK_ROWS
+        || raw_len % rowbytes != 0
+        || uncompress(block, &raw_len, payload, sizes[1]) != Z_OK
+        || raw_len != sizes[0]) 
+      {
+        free(block);
+        return ERROR;
+      }
+      crc = crc32(crc, block, raw_len);
+      int first_row = written / rowbytes;
+      for (int r = 0; r < raw_len / rowbytes; r++) {
+        write_canvas_row(c, first_row + r, &block[r * rowbytes]);
+      }
+      payload += sizes[1];
+      written += raw_len;
+    }
+    free(block);
+    if (written != bytec) {
+      return ERROR;
+    }
+  }
+
+  if (crc != header.checksum) {
+    return ERROR;
+  }
+
+  return SUCCESS;
+}
+
+/// loads a snapshot (see struct snapshot_header) as the image
+static int load_snapshot(const unsigned char *data, size_t size) {
+  reset_image();
+  return read_snapshot(&image, data, size);
+}
+
+/// loads a failsave file, either the binary snapshot format
+/// or the old text format
+///
+/// the file is mapped into memory so nothing has to be read
+/// byte by byte
+int load_failsave(char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    return ERROR;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) == -1 || st.st_size == 0) {
+    close(fd);
+    return ERROR;
+  }
+
+  unsigned char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return ERROR;
+  }
+  madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+  int result;
+  if (st.st_size >= 4 && memcmp(data, SNAPSHOT_MAGIC, 4) == 0) {
+    result = load_snapshot(data, st.st_size);
+  }
+  else {
+    result = load_legacy_failsave((const char *)data, st.st_size);
+  }
+
+  munmap(data, st.st_size);
+  return result;
+}
+
+/// reads the rest of a png palette image into an indexed image,
+/// the palette of the image is the one of the png (PLTE and tRNS)
+static int load_indexed_png(png_structp png_ptr, png_infop info_ptr, 
+    FILE *f, unsigned int w, unsigned int h) 
+{
+  // set once the row buffer is allocated so it can be freed on errors
+  // (volatile as it is changed after setjmp)
+  unsigned char * volatile buf = NULL;
+
+  if (setjmp(png_jmpbuf(png_ptr))) {
+    png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+    fclose(f);
+    if (buf) {
+      free(buf);
+      free_canvas(&image);
+    }
+    return ERROR;
+  }
+
+  png_colorp plte;
+  int plte_count = 0;
+  png_bytep trns = NULL;
+  int trns_count = 0;
+  png_get_PLTE(png_ptr, info_ptr, &plte, &plte_count);
+  if (png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS)) {
+    png_get_tRNS(png_ptr, info_ptr, &trns, &trns_count, NULL);
+  }
+
+  // less than 8 bits per pixel are unpacked to a byte each
+  png_set_packing(png_ptr);
+  int passes = png_set_interlace_handling(png_ptr);
+  png_read_update_info(png_ptr, info_ptr);
+
+  if (plte_count <= 0 || plte_count > PALETTE_MAX
+    || png_get_rowbytes(png_ptr, info_ptr) != w) 
+  {
+    png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+    fclose(f);
+    return ERROR;
+  }
+
+  alloc_canvas(w, h);
+  image.palette = calloc(1, sizeof(*image.palette));
+  buf = malloc(w);
+  if (!image.palette || !buf) {
+    longjmp(png_jmpbuf(png_ptr), 1);
+  }
+  image.palette->count = plte_count;
+  for (int i = 0; i < plte_count; i++) {
+    make_pixel(plte[i].red, plte[i].green, plte[i].blue, 
+        i < trns_count ? trns[i] : 255, image.palette->colors[i]);
+  }
+
+  // missing tiles are read back as a transparent entry so that
+  // later passes don't allocate them
+  int empty = 0;
+  while (empty < plte_count 
+    && image.palette->colors[empty][ALPHA_OFFSET] != 0) 
+  {
+    empty++;
+  }
+  if (empty == plte_count) {
+    empty = 0;
+  }
+
+  for (int pass = 0; pass < passes; pass++) {
+    for (int row = 0; row < h; row++) {
+      if (passes > 1) {
+        read_index_row(&image, row, empty, buf);
+      }
+      png_read_row(png_ptr, buf, NULL);
+      // entries past the palette are broken, libpng lets them through
+      for (int col = 0; col < w; col++) {
+        if (buf[col] >= plte_count) {
+          buf[col] = 0;
+        }
+      }
+      write_index_row(&image, row, buf);
+    }
+  }
+  png_read_end(png_ptr, NULL);
+  free(buf);
+
+  png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+  fclose(f);
+  return SUCCESS;
+}
+
+int load_image(char *path) {
+
+  // check if path is a failsave filepath and if so load it
+  char filetype[] = ".pcli_failsave";
+  int pathlen = strlen(path);
+  int typelen = strlen(filetype);
+  if (pathlen >= typelen 
+    && strcmp(path + pathlen - typelen, filetype) == 0) 
+  {
+    return load_failsave(path);
+  }
+
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    return ERROR;
+  }
+
+  int read_bytes_amount = 8;
+  unsigned char header[8];
+
+  if (fread(header, 1, read_bytes_amount, f) != read_bytes_amount) 
+  {
+    fclose(f);
+    return ERROR;
+  }
+
+  int is_png = !png_sig_cmp(header, 0, read_bytes_amount);
+  if (!is_png) {
+    fclose(f);
+    return ERROR;
+  }
+
+  rewind(f);
+  
+  png_structp png_ptr = png_create_read_struct(
+      PNG_LIBPNG_VER_STRING, 
+      NULL,
+      NULL,
+      NULL
+    );
+
+  if (!png_ptr) {
+    fclose(f);
+    return ERROR;
+  }
+
+  png_infop info_ptr = png_create_info_struct(png_ptr);
+  
+  if (!info_ptr) {
+    png_destroy_read_struct(&png_ptr, NULL, NULL);
+    fclose(f);
+    return ERROR;
+  }
+
+  // set once the row buffer is allocated so it can be freed on errors
+  // (volatile as it is changed after setjmp)
+  unsigned char * volatile buf = NULL;
+
+  if (setjmp(png_jmpbuf(png_ptr))) {
+    png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+    fclose(f);
+    if (buf) {
+      free(buf);
+      free_canvas(&image);
+    }
+    return ERROR;
+  }
+
+  png_init_io(png_ptr, f);
+  png_read_info(png_ptr, info_ptr);
+
+  unsigned int w;
+  unsigned int h;
+  int bit_depth;
+  int color_type;
+
+  png_get_IHDR(png_ptr, info_ptr, &w, &h, 
+      &bit_depth, &color_type, NULL, NULL, NULL);
+
+  // palette images stay indexed, one byte per pixel
+  if (color_type == PNG_COLOR_TYPE_PALETTE) {
+    return load_indexed_png(png_ptr, info_ptr, f, w, h);
+  }
+
+  // let libpng convert everything else to 8 bit rgba
+  // (gray, 16 bit and missing alpha)
+  png_set_expand(png_ptr);
+  png_set_scale_16(png_ptr);
+  if (color_type == PNG_COLOR_TYPE_GRAY 
+    || color_type == PNG_COLOR_TYPE_GRAY_ALPHA) 
+  {
+    png_set_gray_to_rgb(png_ptr);
+  }
+  if (!(color_type & PNG_COLOR_MASK_ALPHA) 
+    && !png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS)) 
+  {
+    png_set_filler(png_ptr, 0xFF, PNG_FILLER_AFTER);
+  }
+  int passes = png_set_interlace_handling(png_ptr);
+  png_read_update_info(png_ptr, info_ptr);
+
+  if (png_get_rowbytes(png_ptr, info_ptr) != (size_t)w * IMAGE_DEPTH) {
+    png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+    fclose(f);
+    return ERROR;
+  }
+
+  // decode row by row into a buffer which is copied into the tiles
+  // (interlaced images need a pass over all rows per interlace pass,
+  // so the row is read back from the image before every later pass)
+  alloc_canvas(w, h);
+  buf = malloc((size_t)w * IMAGE_DEPTH);
+  if (!buf) {
+    longjmp(png_jmpbuf(png_ptr), 1);
+  }
+  for (int pass = 0; pass < passes; pass++) {
+    for (int row = 0; row < h; row++) {
+      if (passes > 1) {
+        read_canvas_row(&image, row, buf);
+      }
+      png_read_row(png_ptr, buf, NULL);
+      if (pass == passes - 1) {
+        normalize_row(buf, w);
+      }
+      write_canvas_row(&image, row, buf);
+    }
+  }
+  png_read_end(png_ptr, NULL);
+  free(buf);
+
+  png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+  fclose(f);
+  return SUCCESS;
+}
+
+void user_warn_fn() { }
+
+/// opens a temporary file next to path which replaces path
+/// once it is closed with close_temp_file
+///
+/// tmp_path has to hold at least PATH_MAX chars
+FILE *open_temp_file(const char *path, char *tmp_path) {
+  if (snprintf(tmp_path, PATH_MAX, "%s.tmp", path) >= PATH_MAX) {
+    return NULL;
+  }
+  return fopen(tmp_path, "wb");
+}
+
+/// closes a file opened with open_temp_file and renames it to path
+/// (or removes it if writing failed)
+int close_temp_file(FILE *f, const char *tmp_path, const char *path, 
+    int result) 
+{
+  if (fflush(f) != 0 || fsync(fileno(f)) != 0) {
+    result = ERROR;
+  }
+  if (fclose(f) != 0) {
+    result = ERROR;
+  }
+  if (result == SUCCESS && rename(tmp_path, path) != 0) {
+    result = ERROR;
+  }
+  if (result != SUCCESS) {
+    unlink(tmp_path);
+  }
+  return result;
+}
+
+/// filters a row for the png encoder with the given filter type
+/// (PNG_FILTER_VALUE_*) and returns the sum of the filtered bytes
+/// as signed values, lower sums usually compress better
+///
+/// prev is NULL for the first row, out has to hold len + 1 bytes
+static unsigned long filter_row(int type, const unsigned char *row, 
+    const unsigned char *prev, size_t len, unsigned char *out) 
+{
+  unsigned long sum = 0;
+  out[0] = type;
+  for (size_t i = 0; i < len; i++) {
+    int a = i >= IMAGE_DEPTH ? row[i - IMAGE_DEPTH] : 0;
+    int b = prev ? prev[i] : 0;
+    int c = (prev && i >= IMAGE_DEPTH) ? prev[i - IMAGE_DEPTH] : 0;
+    int predict = 0;
+
+    switch (type) {
+      case PNG_FILTER_VALUE_SUB:
+        predict = a;
+        break;
+      case PNG_FILTER_VALUE_UP:
+        predict = b;
+        break;
+      case PNG_FILTER_VALUE_AVG:
+        predict = (a + b) / 2;
+        break;
+      case PNG_FILTER_VALUE_PAETH: {
+        int p = a + b - c;
+        int pa = abs(p - a);
+        int pb = abs(p - b);
+        int pc = abs(p - c);
+        predict = (pa <= pb && pa <= pc) ? a : (pb <= pc) ? b : c;
+        break;
+      }
+      default:
+        break;
+    }
+
+    unsigned char filtered = row[i] - predict;
+    out[i + 1] = filtered;
+    sum += filtered < 128 ? filtered : 256 - filtered;
+  }
+  return sum;
+}
+
+/// filters and deflates a band of rows, runs in its own thread
+///
+/// every band is a raw deflate stream which ends on a byte boundary
+/// (sync flush), so the bands can just be concatenated afterwards
+static void *deflate_band_worker(void *arg) {
+  struct deflate_band *band = arg;
+  const struct canvas *c = band->canvas;
+  size_t row_len = (size_t)c->width * IMAGE_DEPTH;
+  int filters = band->settings->filters;
+  if (filters == PNG_FILTER_DEFAULT_MASK) {
+    filters = PNG_ALL_FILTERS;
+  }
+  int level = band->settings->compression >= 0 
+    ? band->settings->compression : Z_DEFAULT_COMPRESSION;
+
+  band->result = ERROR;
+  band->adler = adler32(0, NULL, 0);
+
+  z_stream strm;
+  memset(&strm, 0, sizeof(strm));
+  if (deflateInit2(&strm, level, Z_DEFLATED, -15, 8, 
+        Z_DEFAULT_STRATEGY) != Z_OK) 
+  {
+    return NULL;
+  }
+
+  size_t raw_len = (row_len + 1) * (band->to - band->from);
+  size_t bound = deflateBound(&strm, raw_len) + 16;
+  band->out = malloc(bound);
+  unsigned char *filtered = malloc(PNG_ROW_FILTERS * (row_len + 1));
+  // the current and the previous row, gathered from the tiles
+  unsigned char *rows = malloc(2 * row_len);
+  if (!band->out || !filtered || !rows) {
+    free(filtered);
+    free(rows);
+    deflateEnd(&strm);
+    return NULL;
+  }
+  strm.next_out = band->out;
+  strm.avail_out = bound;
+
+  if (band->from > 0) {
+    read_canvas_row(c, band->from - 1, &rows[row_len]);
+  }
+  for (int r = band->from; r < band->to; r++) {
+    unsigned char *row = &rows[(r & 1) * row_len];
+    const unsigned char *prev = r > 0 ? &rows[(~r & 1) * row_len] : NULL;
+    read_canvas_row(c, r, row);
+
+    // use the allowed filter with the lowest sum
+    unsigned char *best = NULL;
+    unsigned long best_sum = 0;
+    int masks[PNG_ROW_FILTERS] = { PNG_FILTER_NONE, PNG_FILTER_SUB, 
+      PNG_FILTER_UP, PNG_FILTER_AVG, PNG_FILTER_PAETH };
+    for (int type = 0; type < PNG_ROW_FILTERS; type++) {
+      if (!(filters & masks[type])) {
+        continue;
+      }
+      unsigned char *out = &filtered[type * (row_len + 1)];
+      unsigned long sum = filter_row(type, row, prev, row_len, out);
+      if (!best || sum < best_sum) {
+        best = out;
+        best_sum = sum;
+      }
+    }
+    if (!best) {
+      best = filtered;
+      filter_row(PNG_FILTER_VALUE_NONE, row, prev, row_len, best);
+    }
+
+    band->adler = adler32(band->adler, best, row_len + 1);
+    strm.next_in = best;
+    strm.avail_in = row_len + 1;
+    if (deflate(&strm, Z_NO_FLUSH) != Z_OK) {
+      free(filtered);
+      free(rows);
+      deflateEnd(&strm);
+      return NULL;
+    }
+  }
+
+  int flush = band->last ? Z_FINISH : Z_SYNC_FLUSH;
+  int ret = deflate(&strm, flush);
+  free(filtered);
+  free(rows);
+  band->len = bound - strm.avail_out;
+  deflateEnd(&strm);
+
+  if ((band->last && ret == Z_STREAM_END) || (!band->last && ret == Z_OK)) {
+    band->result = SUCCESS;
+  }
+  return NULL;
+}
+
+static const unsigned char png_signature[8] = { 
+  137, 'P', 'N', 'G', '\r', '\n', 26, '\n' };
+
+/// writes a png chunk with the given type and data
+static int write_png_chunk(FILE *f, const char *type, 
+    const unsigned char *data, size_t len) 
+{
+  unsigned char len_bytes[4] = { len >> 24, len >> 16, len >> 8, len };
+  uLong crc = crc32(0, (const unsigned char *)type, 4);
+  if (len > 0) {
+    crc = crc32(crc, data, len);
+  }
+  unsigned char crc_bytes[4] = { crc >> 24, crc >> 16, crc >> 8, crc };
+
+  if (fwrite(len_bytes, 1, 4, f) != 4 || fwrite(type, 1, 4, f) != 4
+    || (len > 0 && fwrite(data, 1, len, f) != len) 
+    || fwrite(crc_bytes, 1, 4, f) != 4) 
+  {
+    return ERROR;
+  }
+  return SUCCESS;
+}
+
+/// saves the canvas as png and deflates bands of rows in parallel
+///
+/// the raw deflate streams of the bands are stitched together into
+/// one zlib stream (header, bands, combined adler32) and written as
+/// IDAT chunks, so the file is a normal png
+int save_image_parallel(const struct canvas *c, const char *path, 
+    const struct png_settings *settings) 
+{
+  int threads = settings->threads;
+  if (threads <= 0) {
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  threads = MAX(MIN(threads, (int)c->height), 1);
+
+  struct deflate_band *bands = calloc(threads, sizeof(*bands));
+  if (!bands) {
+    return ERROR;
+  }
+
+  for (int i = 0; i < threads; i++) {
+    bands[i].canvas = c;
+    bands[i].settings = settings;
+    bands[i].from = (int)((long)c->height * i / threads);
+    bands[i].to = (int)((long)c->height * (i + 1) / threads);
+    bands[i].last = i == threads - 1;
+    bands[i].threaded = pthread_create(&bands[i].thread, NULL, 
+        deflate_band_worker, &bands[i]) == 0;
+    if (!bands[i].threaded) {
+      // deflate the band on this thread instead
+      deflate_band_worker(&bands[i]);
+    }
+  }
+  for (int i = 0; i < threads; i++) {
+    if (bands[i].threaded) {
+      pthread_join(bands[i].thread, NULL);
+    }
+  }
+
+  int result = SUCCESS;
+  uLong adler = adler32(0, NULL, 0);
+  for (int i = 0; i < threads; i++) {
+    if (bands[i].result != SUCCESS) {
+      result = ERROR;
+      continue;
+    }
+    size_t raw_len = ((size_t)c->width * IMAGE_DEPTH + 1) 
+      * (bands[i].to - bands[i].from);
+    adler = adler32_combine(adler, bands[i].adler, raw_len);
+  }
+
+  char tmp_path[PATH_MAX];
+  FILE *f = result == SUCCESS ? open_temp_file(path, tmp_path) : NULL;
+  if (f) {
+    unsigned char ihdr[13] = {
+      c->width >> 24, c->width >> 16, c->width >> 8, c->width,
+      c->height >> 24, c->height >> 16, c->height >> 8, c->height,
+      8, PNG_COLOR_TYPE_RGBA, PNG_COMPRESSION_TYPE_BASE, 
+      PNG_FILTER_TYPE_BASE, PNG_INTERLACE_NONE
+    };
+    // zlib header (deflate, 32k window, check bits for level hint)
+    int level = settings->compression;
+    unsigned char zlib_header[2] = { 0x78, 
+      level < 0 ? 0x9C : level < 2 ? 0x01 : level < 6 ? 0x5E : 
+      level == 6 ? 0x9C : 0xDA };
+    unsigned char zlib_trailer[4] = { 
+      adler >> 24, adler >> 16, adler >> 8, adler };
+
+    if (fwrite(png_signature, 1, 8, f) != 8
+      || write_png_chunk(f, "IHDR", ihdr, sizeof(ihdr)) != SUCCESS
+      || write_png_chunk(f, "IDAT", zlib_header, 2) != SUCCESS) 
+    {
+      result = ERROR;
+    }
+    for (int i = 0; i < threads && result == SUCCESS; i++) {
+      result = write_png_chunk(f, "IDAT", bands[i].out, bands[i].len);
+    }
+    if (result == SUCCESS 
+      && (write_png_chunk(f, "IDAT", zlib_trailer, 4) != SUCCESS
+        || write_png_chunk(f, "IEND", NULL, 0) != SUCCESS)) 
+    {
+      result = ERROR;
+    }
+    result = close_temp_file(f, tmp_path, path, result);
+  }
+  else {
+    result = ERROR;
+  }
+
+  for (int i = 0; i < threads; i++) {
+    free(bands[i].out);
+  }
+  free(bands);
+  return result;
+}
+
+/// saves the canvas as png
+///
+/// the file is written to a temporary file first which
+/// replaces path once it is complete
+int save_image(const struct canvas *c, const char *path, 
+    const struct png_settings *settings) 
+{
+  // indexed images are always written by libpng
+  if (settings->threads != 1 && c->height > 1 && !c->palette) {
+    return save_image_parallel(c, path, settings);
+  }
+
+  png_structp png_ptr = png_create_write_struct(
+      PNG_LIBPNG_VER_STRING, 
+      NULL, 
+      NULL, 
+      &user_warn_fn
+    );
+
+  if (!png_ptr) {
+    return ERROR;
+  }
+
+  png_infop info_ptr = png_create_info_struct(png_ptr);
+  if (!info_ptr) {
+    png_destroy_write_struct(&png_ptr, (png_infopp)NULL);
+    return ERROR;
+  }
+
+  char tmp_path[PATH_MAX];
+  FILE *f = open_temp_file(path, tmp_path);
+
+  if (!f) {
+    png_destroy_write_struct(&png_ptr, &info_ptr);
+    return ERROR;
+  }
+
+  // row buffer for the rows gathered from the tiles
+  // (volatile as it is changed after setjmp)
+  unsigned char * volatile row = NULL;
+  if (setjmp(png_jmpbuf(png_ptr))) {
+    free(row);
+    png_destroy_write_struct(&png_ptr, &info_ptr);
+    close_temp_file(f, tmp_path, path, ERROR);
+    return ERROR;
+  }
+
+  png_init_io(png_ptr, f);
+
+  png_set_IHDR(png_ptr, info_ptr, 
+      c->width, c->height, 
+      8, c->palette ? PNG_COLOR_TYPE_PALETTE : PNG_COLOR_TYPE_RGBA, 
+      PNG_INTERLACE_NONE, 
+      PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT
+    );
+
+  // the palette is written as PLTE and its alpha as tRNS
+  int empty = 0; // the entry of missing tiles
+  if (c->palette) {
+    png_color plte[PALETTE_MAX];
+    png_byte trns[PALETTE_MAX];
+    int count = c->palette->count;
+    int trns_count = 0;
+    empty = -1;
+    for (int i = 0; i < count; i++) {
+      const unsigned char *px = c->palette->colors[i];
+      plte[i].red = px[RED_OFFSET];
+      plte[i].green = px[GREEN_OFFSET];
+      plte[i].blue = px[BLUE_OFFSET];
+      trns[i] = px[ALPHA_OFFSET];
+      if (trns[i] != 255) {
+        trns_count = i + 1;
+      }
+      if (empty == -1 && trns[i] == 0) {
+        empty = i;
+      }
+    }
+    // missing tiles need a transparent entry, one is added if there
+    // is none (a full palette without one uses the first entry)
+    if (empty == -1) {
+      empty = 0;
+      for (size_t t = 0; t < (size_t)c->tile_rows * c->tile_cols; t++) {
+        if (!c->tiles[t] && count < PALETTE_MAX) {
+          empty = count;
+          break;
+        }
+      }
+    }
+    if (empty == count) {
+      plte[count].red = transparency_color[0];
+      plte[count].green = transparency_color[1];
+      plte[count].blue = transparency_color[2];
+      trns[count] = 0;
+      trns_count = ++count;
+    }
+    png_set_PLTE(png_ptr, info_ptr, plte, count);
+    if (trns_count > 0) {
+      png_set_tRNS(png_ptr, info_ptr, trns, trns_count, NULL);
+    }
+  }
+  if (settings->compression >= 0) {
+    png_set_compression_level(png_ptr, settings->compression);
+  }
+  if (settings->filters != PNG_FILTER_DEFAULT_MASK) {
+    png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, settings->filters);
+  }
+  
+  // save image to file row by row
+  row = malloc((size_t)c->width * IMAGE_DEPTH);
+  if (!row) {
+    png_error(png_ptr, "malloc");
+  }
+  png_write_info(png_ptr, info_ptr);
+  for (int r = 0; r < c->height; r++) {
+    if (c->palette) {
+      read_index_row(c, r, empty, row);
+    }
+    else {
+      read_canvas_row(c, r, row);
+    }
+    png_write_row(png_ptr, row);
+  }
+  png_write_end(png_ptr, info_ptr);
+
+  // free everything
+  free(row);
+  png_destroy_write_struct(&png_ptr, &info_ptr);
+  return close_temp_file(f, tmp_path, path, SUCCESS);
+}
+
+/// writes the canvas in the binary snapshot format to f
+/// (see struct snapshot_header)
+///
+/// the pixel rows are written as they are in memory or as
+/// deflated blocks if compressed is set
+int write_snapshot(const struct canvas *c, FILE *f, int compressed) {
+  size_t row_bytec = (size_t)c->width * IMAGE_DEPTH;
+  int block_rows = compressed ? SNAPSHOT_BLOCK_ROWS : 1;
+
+  // rows are gathered from the tiles into this buffer,
+  // a whole block of them when compressing
+  unsigned char *rows = malloc(row_bytec * block_rows);
+  if (!rows) {
+    return ERROR;
+  }
 
-  // direction specific setup
-  if (dir < 0) {
-    // return if in first column
-    if (cursor_col == 0) {
-      return;
+  struct snapshot_header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, SNAPSHOT_MAGIC, 4);
+  header.version = SNAPSHOT_VERSION;
+  header.width = c->width;
+  header.height = c->height;
+  header.checksum = crc32(0, NULL, 0);
+  for (int r = 0; r < c->height; r++) {
+    read_canvas_row(c, r, rows);
+    header.checksum = crc32(header.checksum, rows, row_bytec);
+  }
+  if (compressed) {
+    header.flags |= SNAPSHOT_COMPRESSED;
+    header.blockc = (c->height + SNAPSHOT_BLOCK_ROWS - 1) 
+      / SNAPSHOT_BLOCK_ROWS;
+  }
+
+  int result = SUCCESS;
+  if (fwrite(&header, sizeof(header), 1, f) != 1) {
+    result = ERROR;
+  }
+  else if (!compressed) {
+    for (int r = 0; r < c->height && result == SUCCESS; r++) {
+      read_canvas_row(c, r, rows);
+      if (fwrite(rows, 1, row_bytec, f) != row_bytec) {
+        result = ERROR;
+      }
+    }
+  }
+  else {
+    uLongf bound = compressBound(row_bytec * SNAPSHOT_BLOCK_ROWS);
+    unsigned char *block = malloc(bound);
+    if (!block) {
+      free(rows);
+      return ERROR;
     }
 
-    diff = cursor_col;
-    command = 'D';
+    for (int start = 0; start < c->height && result == SUCCESS; 
+        start += SNAPSHOT_BLOCK_ROWS) 
+    {
+      int count = MIN(SNAPSHOT_BLOCK_ROWS, (int)c->height - start);
+      for (int r = 0; r < count; r++) {
+        read_canvas_row(c, start + r, &rows[r * row_bytec]);
+      }
 
-    // check if cursor is at beginning of color region
-    // and if so change the color to the adjacent one
-    // so that it later won't stop because it sees a 
-    // different color right away
-    if (cmp_pixel_color_by_index(
-          index, index - BYTES_PER_CHAR
-        ) == 1) 
+      uint32_t sizes[2]; // raw size, compressed size
+      uLongf comp_len = bound;
+      sizes[0] = count * row_bytec;
+      if (compress2(block, &comp_len, rows, sizes[0], 
+            Z_BEST_SPEED) != Z_OK) 
+      {
+        result = ERROR;
+        break;
+      }
+      sizes[1] = comp_len;
+
+      if (fwrite(sizes, sizeof(sizes), 1, f) != 1 
+        || fwrite(block, 1, comp_len, f) != comp_len) 
+      {
+        result = ERROR;
+      }
+    }
+    free(block);
+  }
+
+  free(rows);
+  return result;
+}
+
+/// saves the image in the binary snapshot format,
+/// compressed if snapshot_compression is set in the config
+int save_snapshot(const struct canvas *c, const char *path) {
+  char tmp_path[PATH_MAX];
+  FILE *f = open_temp_file(path, tmp_path);
+  if (!f) {
+    return ERROR;
+  }
+  int result = write_snapshot(c, f, snapshot_compression);
+  return close_temp_file(f, tmp_path, path, result);
+}
+
+/*** buffers ***/
+
+/// returns the memory the tiles of a canvas take
+static size_t canvas_bytes(const struct canvas *c) {
+  size_t tiles = (size_t)c->tile_rows * c->tile_cols;
+  size_t bytes = tiles * sizeof(*c->tiles);
+  for (size_t t = 0; t < tiles; t++) {
+    if (c->tiles[t]) {
+      bytes += c->palette ? TILE_PIXELS : TILE_BYTES;
+    }
+  }
+  return bytes;
+}
+
+/// returns the memory the canvases of an image with its layers take
+static size_t image_bytes(const struct canvas *img, 
+    const struct layer_stack *l) 
+{
+  size_t bytes = canvas_bytes(img);
+  for (int i = 0; l->composited && i < l->count; i++) {
+    bytes += canvas_bytes(&l->items[i].canvas);
+  }
+  return bytes;
+}
+
+/// returns the memory the canvases of a buffer which isn't 
+/// current take
+static size_t buffer_bytes(const struct buffer *b) {
+  switch (b->state) {
+    case BUFFER_RESIDENT:
+      return image_bytes(&b->image, &b->layers);
+    case BUFFER_PACKED: {
+      size_t bytes = 0;
+      for (int i = 0; i < b->layers.count; i++) {
+        bytes += b->packed[i].len;
+      }
+      return bytes;
+    }
+    default:
+      return 0;
+  }
+}
+
+/// returns the canvas of a buffer which is packed into packed[inx]
+static struct canvas *packed_canvas(struct buffer *b, int inx) {
+  return b->layers.composited ? &b->layers.items[inx].canvas : &b->image;
+}
+
+/// builds the path of the file a packed canvas is spilled to
+static void spill_path(int buffer, int inx, char *out) {
+  const char *dir = getenv("TMPDIR");
+  snprintf(out, PATH_MAX, "%s/pixelcli-%d-%d-%d.pcli_failsave", 
+      dir ? dir : "/tmp", (int)getpid(), buffer, inx);
+}
+
+/// compresses the canvases of a buffer into snapshots in memory
+///
+/// returns ERROR if there is not enough memory, 
+/// the buffer is unchanged then
+static int pack_buffer(struct buffer *b) {
+  int count = b->layers.count;
+  for (int i = 0; i < count; i++) {
+    struct packed_canvas *p = &b->packed[i];
+    FILE *f = open_memstream((char **)&p->data, &p->len);
+    if (!f || write_snapshot(packed_canvas(b, i), f, 1) == ERROR) {
+      if (f) {
+        fclose(f);
+      }
+      for (int j = 0; j <= i; j++) {
+        free(b->packed[j].data);
+        memset(&b->packed[j], 0, sizeof(b->packed[j]));
+      }
+      return ERROR;
+    }
+    fclose(f);
+  }
+
+  // snapshots are rgba, the palettes are kept as they are
+  for (int i = 0; i < count; i++) {
+    struct canvas *c = packed_canvas(b, i);
+    b->packed[i].width = c->width;
+    b->packed[i].height = c->height;
+    b->packed[i].palette = c->palette;
+    c->palette = NULL;
+    free_canvas(c);
+  }
+  // the composite is built again from the layers
+  free_canvas(&b->image);
+  b->state = BUFFER_PACKED;
+  return SUCCESS;
+}
+
+/// writes the snapshots of a packed buffer to files
+///
+/// returns ERROR if they couldn't be written, 
+/// the buffer is unchanged then
+static int spill_buffer(int inx) {
+  struct buffer *b = &buffers[inx];
+  char path[PATH_MAX];
+  for (int i = 0; i < b->layers.count; i++) {
+    spill_path(inx, i, path);
+    FILE *f = fopen(path, "wb");
+    int written = f && fwrite(b->packed[i].data, 1, b->packed[i].len, f) 
+      == b->packed[i].len;
+    if (!f || fclose(f) != 0 || !written) {
+      for (int j = 0; j <= i; j++) {
+        spill_path(inx, j, path);
+        unlink(path);
+      }
+      return ERROR;
+    }
+  }
+  for (int i = 0; i < b->layers.count; i++) {
+    free(b->packed[i].data);
+    b->packed[i].data = NULL;
+  }
+  b->state = BUFFER_SPILLED;
+  return SUCCESS;
+}
+
+/// unpacks the canvases of a packed or spilled buffer,
+/// its composite is built again before the next frame
+///
+/// returns ERROR if a spilled snapshot can't be read back
+static int unpack_buffer(int inx) {
+  struct buffer *b = &buffers[inx];
+  char path[PATH_MAX];
+  int result = SUCCESS;
+  for (int i = 0; i < b->layers.count; i++) {
+    struct packed_canvas *p = &b->packed[i];
+    struct canvas *c = packed_canvas(b, i);
+    unsigned char *data = p->data;
+    if (!data) {
+      spill_path(inx, i, path);
+      int fd = open(path, O_RDONLY);
+      data = fd == -1 ? MAP_FAILED 
+        : mmap(NULL, p->len, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (fd != -1) {
+        close(fd);
+      }
+      unlink(path);
+      if (data == MAP_FAILED) {
+        data = NULL;
+      }
+    }
+
+    memset(c, 0, sizeof(*c));
+    int restored = data && read_snapshot(c, data, p->len) == SUCCESS;
+    if (!restored) {
+      free(p->palette);
+    }
+    else if (p->palette && recode_canvas(c, p->palette) == ERROR) {
+      restored = 0;
+    }
+    if (!restored) {
+      // what can't be restored is lost, but the buffer stays usable
+      free_canvas(c);
+      if (init_canvas(c, p->width, p->height) == ERROR) {
+        die("calloc");
+      }
+      result = ERROR;
+    }
+
+    if (p->data) {
+      free(p->data);
+      p->data = NULL;
+    }
+    else if (data) {
+      munmap(data, p->len);
+    }
+    p->palette = NULL;
+  }
+
+  if (b->layers.composited) {
+    if (init_canvas(&b->image, b->packed[0].width, b->packed[0].height) 
+        == ERROR) 
+    {
+      die("calloc");
+    }
+    memset(b->layers.dirty, 1, 
+        (size_t)b->image.tile_rows * b->image.tile_cols);
+    b->layers.any_dirty = 1;
+  }
+  b->state = BUFFER_RESIDENT;
+  return result;
+}
+
+/// moves the current image with everything that belongs to it
+/// into its buffer and leaves an empty image behind
+static void stash_buffer(struct buffer *b) {
+  b->image = image;
+  b->layers = layers;
+  b->history = history;
+  b->history_len = history_len;
+  b->history_cap = history_cap;
+  b->history_pos = history_pos;
+  b->history_bytes = history_bytes;
+  b->x_offset = x_offset;
+  b->y_offset = y_offset;
+  b->x_cursor = x_cursor;
+  b->y_cursor = y_cursor;
+  b->state = BUFFER_RESIDENT;
+
+  memset(&image, 0, sizeof(image));
+  memset(&layers, 0, sizeof(layers));
+  reset_layers();
+  mip_reset();
+  history = NULL;
+  history_len = 0;
+  history_cap = 0;
+  history_pos = 0;
+  history_bytes = 0;
+  x_offset = 0;
+  y_offset = 0;
+  x_cursor = 0;
+  y_cursor = 0;
+  selected_row = -1;
+  selected_col = -1;
+  pending_move.from_row = -1;
+}
+
+/// makes the resident buffer the current image again
+static void restore_buffer(struct buffer *b) {
+  image = b->image;
+  layers = b->layers;
+  history = b->history;
+  history_len = b->history_len;
+  history_cap = b->history_cap;
+  history_pos = b->history_pos;
+  history_bytes = b->history_bytes;
+  x_offset = b->x_offset;
+  y_offset = b->y_offset;
+  x_cursor = b->x_cursor;
+  y_cursor = b->y_cursor;
+  memset(&b->image, 0, sizeof(b->image));
+  memset(&b->layers, 0, sizeof(b->layers));
+  b->history = NULL;
+}
+
+/// packs the least recently used buffers until all canvases fit into 
+/// buffer_budget, if that isn't enough the packed ones are spilled
+void fit_buffers() {
+  while (1) {
+    size_t total = image_bytes(&image, &layers);
+    for (int i = 0; i < bufferc; i++) {
+      total += i == current_buffer ? 0 : buffer_bytes(&buffers[i]);
+    }
+    if (total <= buffer_budget) {
+      return;
+    }
+
+    // resident buffers are packed before packed ones are spilled
+    int lru = -1;
+    for (int state = BUFFER_RESIDENT; lru == -1 && state <= BUFFER_PACKED; 
+        state++) 
     {
-      origin_pixel = index - BYTES_PER_CHAR;
+      for (int i = 0; i < bufferc; i++) {
+        if (i != current_buffer && buffers[i].state == state 
+          && (lru == -1 || buffers[i].used < buffers[lru].used)) 
+        {
+          lru = i;
+        }
+      }
+    }
+    if (lru == -1) {
+      return;
+    }
+    int result = buffers[lru].state == BUFFER_RESIDENT 
+      ? pack_buffer(&buffers[lru]) : spill_buffer(lru);
+    if (result == ERROR) {
+      return;
+    }
+  }
+}
+
+/// makes another buffer the current one, 
+/// the one that was current is kept in its buffer
+///
+/// returns ERROR if the buffer's file couldn't be loaded or restored
+/// (a file which can't be loaded leaves the current buffer as it is)
+int switch_buffer(int inx) {
+  if (inx == current_buffer || inx < 0 || inx >= bufferc) {
+    return SUCCESS;
+  }
+  struct buffer *from = &buffers[current_buffer];
+  struct buffer *to = &buffers[inx];
+  int result = SUCCESS;
+
+  stash_buffer(from);
+  if (to->state == BUFFER_UNLOADED) {
+    if (load_image(to->path) == ERROR) {
+      reset_image();
+      restore_buffer(from);
+      return ERROR;
     }
   }
   else {
-    // return if in last column
-    if (cursor_col == MIN(term.cols, image_width) - 1) { 
-      return; 
+    if (to->state != BUFFER_RESIDENT) {
+      result = unpack_buffer(inx);
+    }
+    restore_buffer(to);
+  }
+  to->state = BUFFER_RESIDENT;
+
+  from->used = ++buffer_clock;
+  current_buffer = inx;
+  fit_buffers();
+  return result;
+}
+
+/// removes the files of spilled buffers
+void remove_spilled_buffers() {
+  char path[PATH_MAX];
+  for (int i = 0; i < bufferc; i++) {
+    if (buffers[i].state != BUFFER_SPILLED) {
+      continue;
     }
+    for (int j = 0; j < buffers[i].layers.count; j++) {
+      spill_path(i, j, path);
+      unlink(path);
+    }
+  }
+}
+
+/*** saving ***/
+
+/// saves the frozen copy of the image, runs in the save thread
+///
+/// if the png export fails the failsave is written instead
+void *save_worker(void *arg) {
+  struct save_job *job = arg;
 
-    diff = MIN(term.cols, image_width) - cursor_col - 1;
-    command = 'C';
+  if (save_image(&job->canvas, job->path, &job->settings) == SUCCESS) {
+    job->result = SAVED_PNG;
+  }
+  else if (save_snapshot(&job->canvas, FAILSAVE_PATH) == SUCCESS) {
+    job->result = SAVED_FAILSAVE;
+  }
+  else {
+    job->result = ERROR;
   }
 
-  // search for color change in the given direction
-  for (int i = 0; i < diff; i++) {
-    index += dir * BYTES_PER_CHAR;
-    if (cmp_pixel_color_by_index(origin_pixel, index) == 1) {
-      move_by = i + ((dir > 0) ? 1 : 0);
+  // wake up the input loop
+  write(event_pipe[1], "s", 1);
+  return NULL;
+}
+
+/// builds the path a file is saved to from a pattern,
+/// {} in the pattern is the name of the file
+void expand_save_path(const char *pattern, const char *file, char *out) {
+  const char *base = strrchr(file, '/');
+  base = base ? base + 1 : file;
+  const char *marker = strstr(pattern, "{}");
+  if (!marker) {
+    snprintf(out, PATH_MAX, "%s", pattern);
+    return;
+  }
+  snprintf(out, PATH_MAX, "%.*s%s%s", 
+      (int)(marker - pattern), pattern, base, marker + 2);
+}
+
+/// builds the path a file is saved to without a save path, it is
+/// next to the file with _out.png instead of its extension
+/// (the file itself might not even be a png)
+void default_save_path(const char *file, char *out) {
+  const char *base = strrchr(file, '/');
+  base = base ? base + 1 : file;
+  const char *ext = strrchr(base, '.');
+  int len = ext && ext != base ? ext - file : (int)strlen(file);
+  snprintf(out, PATH_MAX, "%.*s_out.png", len, file);
+}
+
+/// saves the image in the background with the given png settings
+///
+/// the pixels are copied so editing can go on while
+/// the save thread encodes and writes them
+int start_save(const struct png_settings *settings) {
+  if (save_running) {
+    set_status("already saving...");
+    return ERROR;
+  }
+
+  // with several files a path without {} would be the same for
+  // all of them, the default is then derived from the buffer's file
+  const char *file = buffers ? buffers[current_buffer].path : "";
+  char path[PATH_MAX];
+  if (bufferc > 1 && !strstr(save_path, "{}")) {
+    if (save_path_set) {
+      set_status("save_path needs {} with several files");
+      return ERROR;
+    }
+    default_save_path(file, path);
+  }
+  else {
+    expand_save_path(save_path, file, path);
+  }
+
+  update_composite();
+  if (copy_canvas(&save_job.canvas, &image) == ERROR) {
+    set_status("not enough memory to save");
+    return ERROR;
+  }
+  save_job.settings = *settings;
+  strcpy(save_job.path, path);
+
+  if (pthread_create(&save_thread, NULL, save_worker, &save_job) != 0) {
+    free_canvas(&save_job.canvas);
+    set_status("couldn't start saving");
+    return ERROR;
+  }
+  save_running = 1;
+  set_status("saving %s...", save_job.path);
+  return SUCCESS;
+}
+
+/// waits for a running save and reports how it went
+void finish_save() {
+  if (!save_running) {
+    return;
+  }
+  pthread_join(save_thread, NULL);
+  save_running = 0;
+  free_canvas(&save_job.canvas);
+
+  switch (save_job.result) {
+    case SAVED_PNG:
+      set_status("saved %s", save_job.path);
+      break;
+    case SAVED_FAILSAVE:
+      set_status("error on save! resorted to %s", FAILSAVE_PATH);
+      break;
+    default:
+      set_status("error on save!");
       break;
+  }
+}
+
+/// keeps the offsets from scrolling past what offset_down and 
+/// offset_right allow, e.g. after the screen grew
+void clamp_offsets() {
+  int step = cells_to_pixels(1) > 0 ? cells_to_pixels(1) : 1;
+  int cells = pixels_to_cells(step); // cells one step scrolls by
+
+  y_offset = MAX(MIN(y_offset, (int)image.height - 1), 0) / step * step;
+  x_offset = MAX(MIN(x_offset, (int)image.width - 1), 0) / step * step;
+  while (y_offset > 0 && view_rows() + cells <= term.rows) {
+    y_offset -= step;
+  }
+  while (x_offset > 0 && view_cols() + cells <= term.cols) {
+    x_offset -= step;
+  }
+}
+
+/// measures the terminal again after a resize and repaints it
+void handle_resize() {
+  resize_pending = 0;
+  set_terminal_size();
+  clamp_offsets();
+  clear_screen();
+  print_screen();
+}
+
+/// handles everything other threads and signal handlers 
+/// reported through the event pipe
+void handle_events() {
+  char events[16];
+  ssize_t nread = read(event_pipe[0], events, sizeof(events));
+  for (ssize_t i = 0; i < nread; i++) {
+    if (events[i] == 's') {
+      finish_save();
+    }
+    else if (events[i] == 'w') {
+      handle_resize();
     }
   }
+  render_frame();
+}
 
-  // if no color change was found move to beginning/end
-  if (move_by < 0) {
-    move_by = diff;
+/// returns the next byte of input, it is read from stdin in chunks 
+/// of everything that is available
+///
+/// before waiting for more input the deferred frame is drawn,
+/// events are handled while waiting
+char poll_input() {
+  if (input.pos < input.len) {
+    return input.buf[input.pos++];
+  }
+
+  struct pollfd fds[2] = {
+    { .fd = STDIN_FILENO, .events = POLLIN },
+    { .fd = event_pipe[0], .events = POLLIN },
+  };
+
+  while (1) {
+    flush_render();
+    if (poll(fds, 2, -1) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      die("poll");
+    }
+
+    if (fds[1].revents & POLLIN) {
+      handle_events();
+      // measuring the terminal can read input past its answer
+      if (input.pos < input.len) {
+        return input.buf[input.pos++];
+      }
+    }
+
+    if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+      ssize_t nread = read(STDIN_FILENO, input.buf, sizeof(input.buf));
+      if (nread <= 0) {
+        if (nread == -1 && errno != EAGAIN && errno != EINTR) {
+          die("read");
+        }
+        if (nread == 0) {
+          die("read");
+        }
+        continue;
+      }
+      input.len = nread;
+      input.pos = 1;
+      return input.buf[0];
+    }
+  }
+}
+
+/// waits for the next key (a byte or one of KEY_*)
+int read_key() {
+  return decode_key((unsigned char)poll_input());
+}
+
+void log_image() {
+  FILE *f = fopen("log.txt", "w");
+  for (int r = 0; r < image.height; r++) {
+    for (int c = 0; c < image.width; c++) {
+      const unsigned char *px = get_pixel(&image, r, c);
+      fprintf(f, "%02x%02x%02x%02x ", px[RED_OFFSET], px[GREEN_OFFSET], 
+          px[BLUE_OFFSET], px[ALPHA_OFFSET]);
+    }
+    fprintf(f, "\n");
+  }
+  die("\nlog done");
+}
+
+/// changes the zoom level and keeps the pixel under the cursor
+/// (row, col) in view, the whole screen is redrawn
+void set_zoom(int level, int row, int col) {
+  // zooming out further than the whole image makes no sense
+  int fits = zoom <= 0 && mip_size(image.width, -zoom) <= term.cols 
+    && mip_size(image.height, -zoom) <= term.rows;
+  if (level > ZOOM_IN_MAX || level < -MIP_LEVELS_MAX 
+    || (level < zoom && fits)) 
+  {
+    return;
+  }
+  zoom = level;
+
+  // center the view on the pixel, zoomed out the offsets
+  // have to be multiples of the pixels per cell
+  int step = cells_to_pixels(1) > 0 ? cells_to_pixels(1) : 1;
+  y_offset = MAX(row - cells_to_pixels(term.rows / 2), 0) / step * step;
+  x_offset = MAX(col - cells_to_pixels(term.cols / 2), 0) / step * step;
+  y_cursor = pixels_to_cells(row - y_offset);
+  x_cursor = pixels_to_cells(col - x_offset);
+
+  if (zoom < 0) {
+    set_status("zoom %d:1", 1 << -zoom);
+  }
+  else {
+    set_status("zoom 1:%d", 1 << zoom);
   }
-
-  // round down to next even number so that there cannot be a
-  // move by half a pixel
-  move_by -= move_by % 2;
-
-  // move by calculated amount in specified direction (command var)
-  char *buf = malloc(10);
-  int len = sprintf(buf, "\x1b[%d%c", move_by, command);
-  write(STDOUT_FILENO, buf, len);
-  free(buf);
+  print_screen();
 }
 
-static inline int readline(char **line, size_t *len, FILE *f) {
-  ssize_t read_bytes;
-  if ((read_bytes = getline(line, len, f)) <= 0) {
-    perror("empty file");
-    exit(1);
-  }
-  return read_bytes;
+/// cells the cursor moves by for one pixel
+static inline int cursor_step() {
+  return pixels_to_cells(1) > 0 ? pixels_to_cells(1) : 1;
 }
 
-int load_failsave(char *path) {
-  FILE *f = fopen(path, "rb");
-  if (!f) {
-    return ERROR;
-  }
+/// pixels the offsets move by for one cell
+static inline int offset_step() {
+  return cells_to_pixels(1) > 0 ? cells_to_pixels(1) : 1;
+}
 
-  char *line = NULL;
-  unsigned long line_len;
-  long read_bytes;
+// the handlers of the commands, arg comes from the command table and
+// count is how often the command was typed (1 without a count)
 
-  // get width
-  readline(&line, &line_len, f);
-  int w = atoi(line);
+static int command_quit(int arg, int count) {
+  return 1;
+}
 
-  // get height
-  readline(&line, &line_len, f);
-  int h = atoi(line);
+static int command_move_left(int arg, int count) {
+  x_cursor -= cursor_step() * MIN(count, term.cols);
+  render_frame();
+  return SUCCESS;
+}
 
-  png_bytepp img = malloc(h);
-  int line_bytec = w * IMAGE_DEPTH;
-  img[0] = malloc(line_bytec + 1);
-  
-  char c;
-  char num[3] = { 0, 0, 0 };
-  int inx = 0;
-  int winx = 0;
-  int hinx = 0;
-
-  while ((c = getc(f)) != EOF) {
-    num[inx] = c;
-    inx++;
-    if (inx < 3) {
-      continue;
-    }
+static int command_move_down(int arg, int count) {
+  y_cursor += cursor_step() * MIN(count, term.rows);
+  render_frame();
+  return SUCCESS;
+}
 
-    img[hinx][winx] = atoi(num);
+static int command_move_up(int arg, int count) {
+  y_cursor -= cursor_step() * MIN(count, term.rows);
+  render_frame();
+  return SUCCESS;
+}
 
-    winx = (winx + 1) % (line_bytec);
-    if (winx == 0) {
-      hinx++;
-      if (hinx != h) {
-        img[hinx - 1][line_bytec] = '\0';
-        img[hinx] = malloc(line_bytec + 1);
-      }
-    }
+static int command_move_right(int arg, int count) {
+  x_cursor += cursor_step() * MIN(count, term.cols);
+  render_frame();
+  return SUCCESS;
+}
 
-    inx = 0;
+static int command_offset_left(int arg, int count) {
+  for (int i = 0; i < count && x_offset > 0; i++) {
+    x_offset -= offset_step();
   }
-
-  init_image(w, h, img, PNG_COLOR_TYPE_RGBA);
-
+  render_frame();
   return SUCCESS;
 }
 
-int load_image(char *path) {
+static int command_offset_down(int arg, int count) {
+  for (int i = 0; i < count && view_rows() > term.rows; i++) {
+    y_offset += offset_step();
+  }
+  render_frame();
+  return SUCCESS;
+}
 
-  // check if path is a failsave filepath and if so load it
-  char filetype[] = ".pcli_failsave";
-  int pathlen = strlen(path);
-  int typelen = strlen(filetype);
-  if (strcmp(path + pathlen - typelen, filetype) == 0) {
-    return load_failsave(path);
+static int command_offset_up(int arg, int count) {
+  for (int i = 0; i < count && y_offset > 0; i++) {
+    y_offset -= offset_step();
   }
+  render_frame();
+  return SUCCESS;
+}
 
-  FILE *f = fopen(path, "rb");
-  if (!f) {
-    return ERROR;
+static int command_offset_right(int arg, int count) {
+  for (int i = 0; i < count && view_cols() > term.cols; i++) {
+    x_offset += offset_step();
   }
+  render_frame();
+  return SUCCESS;
+}
 
-  int read_bytes_amount = 8;
-  unsigned char *header = malloc(sizeof(char) * read_bytes_amount);
+static int command_move_top(int arg, int count) {
+  x_cursor = 0;
+  y_cursor = 0;
+  render_frame();
+  return SUCCESS;
+}
 
-  if (fread(header, 1, read_bytes_amount, f) != read_bytes_amount) 
-  {
-    fclose(f);
-    return ERROR;
-  }
+static int command_move_bottom(int arg, int count) {
+  // clamped to the last visible row when drawn
+  y_cursor = term.rows;
+  render_frame();
+  return SUCCESS;
+}
 
-  int is_png = !png_sig_cmp(header, 0, read_bytes_amount);
-  if (!is_png) {
-    fclose(f);
-    return ERROR;
+/// fills the selection or the pixel under the cursor
+static void fill_at_cursor(int r, int g, int b, int a) {
+  int row = cursor_image_row();
+  int col = cursor_image_col();
+
+  if (selected_row != -1 && selected_col != -1) {
+    fill_selection(selected_row, selected_col, row, col, r, g, b, a);
+    selected_row = -1;
+    selected_col = -1;
+    return;
   }
+  fill_pixel(row, col, r, g, b, a);
+}
 
-  rewind(f);
-  
-  png_structp png_ptr = png_create_read_struct(
-      PNG_LIBPNG_VER_STRING, 
-      NULL,
-      NULL,
-      NULL
-    );
+static int command_fill(int arg, int count) {
+  fill_at_cursor(r_sel, g_sel, b_sel, a_sel);
+  return SUCCESS;
+}
 
-  if (!png_ptr) {
-    fclose(f);
-    return ERROR;
-  }
+static int command_delete(int arg, int count) {
+  fill_at_cursor(0, 0, 0, 0);
+  return SUCCESS;
+}
 
-  png_infop info_ptr = png_create_info_struct(png_ptr);
-  
-  if (!info_ptr) {
-    png_destroy_read_struct(&png_ptr, NULL, NULL);
-    fclose(f);
-    return ERROR;
+static int command_select(int arg, int count) {
+  if (selected_row != -1 && selected_col != -1) {
+    selected_row = -1;
+    selected_col = -1;
+    return SUCCESS;
   }
+  selected_row = cursor_image_row();
+  selected_col = cursor_image_col();
+  return SUCCESS;
+}
 
-  if (setjmp(png_jmpbuf(png_ptr))) {
-    png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
-    fclose(f);
-    return ERROR;
+/// arg is the direction (1 forward, -1 backward)
+static int command_jump(int arg, int count) {
+  for (int i = 0; i < MIN(count, term.cols); i++) {
+    jmp_next_color(cursor_image_row(), cursor_image_col(), arg);
   }
+  return SUCCESS;
+}
 
-  png_init_io(png_ptr, f);
-
-  png_read_png(png_ptr, info_ptr, 
-      PNG_TRANSFORM_SCALE_16 | 
-      PNG_TRANSFORM_GRAY_TO_RGB, 
-      NULL
-    );
+/// arg is the palette index
+static int command_color(int arg, int count) {
+  r_sel = color_palette[arg][0];
+  g_sel = color_palette[arg][1];
+  b_sel = color_palette[arg][2];
+  a_sel = 255;
+  return SUCCESS;
+}
 
-  unsigned int w;
-  unsigned int h;
-  int color_type;
+static int command_save(int arg, int count) {
+  start_save(&png_settings);
+  render_frame();
+  return SUCCESS;
+}
 
-  png_get_IHDR(png_ptr, info_ptr, &w, &h, 
-      NULL, &color_type, NULL, NULL, NULL);
+static int command_reload(int arg, int count) {
+  handle_resize();
+  return SUCCESS;
+}
 
-  png_bytepp row_pointers = png_get_rows(png_ptr, info_ptr);
-  init_image(w, h, row_pointers, color_type);
+static int command_pipette(int arg, int count) {
+  pipette(cursor_image_row(), cursor_image_col());
+  return SUCCESS;
+}
 
-  fclose(f);
+static int command_pipette_save(int arg, int count) {
+  pipette(cursor_image_row(), cursor_image_col());
+  save_pipette_color(read_key());
   return SUCCESS;
 }
 
-png_bytepp get_preprocessed_image() {
-  png_bytepp rows = malloc(SIZEOF_POINTER * image_height);
+static int command_bucket_fill(int arg, int count) {
+  bucket_fill(cursor_image_row(), cursor_image_col(), 
+      r_sel, g_sel, b_sel, a_sel);
+  return SUCCESS;
+}
 
-  for (int r = 0; r < image_height; r++) {
-    rows[r] = malloc(
-      sizeof(png_byte) * (int)(image_width / 2) * IMAGE_DEPTH
-    );
+static int command_undo(int arg, int count) {
+  for (int i = 0; i < count; i++) {
+    undo();
+  }
+  return SUCCESS;
+}
 
-    for (int c = 0; c < (int)(image_width / 2); c++) {
-      int inx = get_inx(r, 2 * c);
-      rows[r][c * IMAGE_DEPTH] = ASCII_TO_NUM(inx + RED_OFFSET);
-      rows[r][c * IMAGE_DEPTH + 1] = ASCII_TO_NUM(inx + GREEN_OFFSET);
-      rows[r][c * IMAGE_DEPTH + 2] = ASCII_TO_NUM(inx + BLUE_OFFSET);
-      rows[r][c * IMAGE_DEPTH + 3] = (
-        rows[r][c * IMAGE_DEPTH] == transparency_color[0] &&
-        rows[r][c * IMAGE_DEPTH + 1] == transparency_color[1] &&
-        rows[r][c * IMAGE_DEPTH + 2] == transparency_color[2]
-      ) ? 0 : 255;
-    }
+static int command_redo(int arg, int count) {
+  for (int i = 0; i < count; i++) {
+    redo();
   }
+  return SUCCESS;
+}
 
-  return rows;
+static int command_save_fast(int arg, int count) {
+  start_save(&png_fast_settings);
+  render_frame();
+  return SUCCESS;
 }
 
-void user_error_fn() {
-  die("png");
+static int command_zoom_in(int arg, int count) {
+  set_zoom(MIN(zoom + count, ZOOM_IN_MAX), 
+      cursor_image_row(), cursor_image_col());
+  return SUCCESS;
 }
 
-void user_warn_fn() { }
+static int command_zoom_out(int arg, int count) {
+  set_zoom(MAX(zoom - count, -MIP_LEVELS_MAX), 
+      cursor_image_row(), cursor_image_col());
+  return SUCCESS;
+}
 
-int save_image() {
-  png_voidp *user_error_ptr;
-  
-  png_structp png_ptr = png_create_write_struct(
-      PNG_LIBPNG_VER_STRING, 
-      (png_voidp)user_error_ptr, 
-      &user_error_fn, 
-      &user_warn_fn
-    );
+static int command_half_block(int arg, int count) {
+  half_block = !half_block;
+  update_view_size();
+  set_status("half blocks %s", half_block ? "on" : "off");
+  clear_screen();
+  print_screen();
+  return SUCCESS;
+}
 
-  if (!png_ptr) {
-    return ERROR;
+/// shows the active layer in the status line
+static void set_layer_status() {
+  const struct layer *l = &layers.items[layers.active];
+  set_status("layer %d/%d: opacity %d, %s%s", 
+      layers.active + 1, layers.count, l->opacity, 
+      blend_names[l->blend], l->visible ? "" : ", hidden");
+}
+
+static int command_layer_add(int arg, int count) {
+  if (add_layer() == ERROR) {
+    set_status("can't add more layers");
   }
+  else {
+    set_layer_status();
+  }
+  render_frame();
+  return SUCCESS;
+}
 
-  png_infop info_ptr = png_create_info_struct(png_ptr);
-  if (!info_ptr) {
-    png_destroy_write_struct(&png_ptr, (png_infopp)NULL);
-    return ERROR;
+static int command_layer_delete(int arg, int count) {
+  if (delete_layer() == ERROR) {
+    set_status("can't delete the only layer");
   }
+  else {
+    set_layer_status();
+  }
+  render_frame();
+  return SUCCESS;
+}
 
-  FILE *f = fopen("./out.png", "wb");
+/// arg is the direction (1 up, -1 down)
+static int command_layer_select(int arg, int count) {
+  layers.active = MAX(MIN(layers.active + arg * count, 
+        layers.count - 1), 0);
+  set_layer_status();
+  render_frame();
+  return SUCCESS;
+}
 
-  if (!f) {
-    return ERROR;
-  }
+static int command_layer_visible(int arg, int count) {
+  separate_layers();
+  struct layer *l = &layers.items[layers.active];
+  l->visible = !l->visible;
+  mark_layer_dirty(layers.active);
+  set_layer_status();
+  render_frame();
+  return SUCCESS;
+}
 
-  if (setjmp(png_jmpbuf(png_ptr))) {
-    png_destroy_write_struct(&png_ptr, &info_ptr);
-    fclose(f);
-    return ERROR;
-  }
+/// arg is the direction (1 more opaque, -1 less)
+static int command_layer_opacity(int arg, int count) {
+  separate_layers();
+  struct layer *l = &layers.items[layers.active];
+  l->opacity = MAX(MIN(l->opacity + arg * count * LAYER_OPACITY_STEP, 
+        255), 0);
+  mark_layer_dirty(layers.active);
+  set_layer_status();
+  render_frame();
+  return SUCCESS;
+}
 
-  png_init_io(png_ptr, f);
+static int command_layer_blend(int arg, int count) {
+  separate_layers();
+  struct layer *l = &layers.items[layers.active];
+  l->blend = (l->blend + 1) % BLEND_MODES;
+  mark_layer_dirty(layers.active);
+  set_layer_status();
+  render_frame();
+  return SUCCESS;
+}
 
-  png_set_IHDR(png_ptr, info_ptr, 
-      (int) (image_width / 2), image_height, 
-      8, PNG_COLOR_TYPE_RGBA, PNG_INTERLACE_NONE, 
-      PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT
-    );
-  
-  // save image to file
-  png_bytepp rows = get_preprocessed_image();
-  png_set_rows(png_ptr, info_ptr, rows);
-  png_write_png(png_ptr, info_ptr, PNG_TRANSFORM_IDENTITY, NULL);
+static int command_indexed(int arg, int count) {
+  struct canvas *c = active_canvas();
+  if (convert_canvas(c, !c->palette) == ERROR) {
+    set_status("too many colors for a palette");
+  }
+  else if (c->palette) {
+    set_status("indexed: %d colors", c->palette->count);
+  }
+  else {
+    set_status("rgba");
+  }
+  render_frame();
+  return SUCCESS;
+}
 
-  // free everything
-  png_destroy_write_struct(&png_ptr, &info_ptr);
-  fclose(f);
+static int command_recolor(int arg, int count) {
+  int inx = recolor_entry(cursor_image_row(), cursor_image_col(), 
+      r_sel, g_sel, b_sel, a_sel);
+  if (inx == ERROR) {
+    set_status("no palette entry here");
+  }
+  else {
+    set_status("palette entry %d: #%02x%02x%02x", 
+        inx, r_sel, g_sel, b_sel);
+  }
+  render_frame();
   return SUCCESS;
 }
 
-int save_image_fallback() {
-  char *img = malloc(3 * IMAGE_DEPTH * 
-                     (image_width / 2) * image_height
-    );
-  int insert_point = 0;
-  for (int i = 0; i < image_bytec; i += 2 * BYTES_PER_CHAR){
-    img[insert_point] = image[i + RED_OFFSET];
-    insert_point++;
-    img[insert_point] = image[i + RED_OFFSET + 1];
-    insert_point++;
-    img[insert_point] = image[i + RED_OFFSET + 2];
-    insert_point++;
-    img[insert_point] = image[i + GREEN_OFFSET];
-    insert_point++;
-    img[insert_point] = image[i + GREEN_OFFSET + 1];
-    insert_point++;
-    img[insert_point] = image[i + GREEN_OFFSET + 2];
-    insert_point++;
-    img[insert_point] = image[i + BLUE_OFFSET];
-    insert_point++;
-    img[insert_point] = image[i + BLUE_OFFSET + 1];
-    insert_point++;
-    img[insert_point] = image[i + BLUE_OFFSET +2];
-    insert_point++;
-    char transparency[] = { '2', '5', '5' };
-    if (
-      ASCII_TO_NUM(i + RED_OFFSET) == transparency_color[0] &&
-      ASCII_TO_NUM(i + GREEN_OFFSET) == transparency_color[1] &&
-      ASCII_TO_NUM(i + BLUE_OFFSET) == transparency_color[2]) 
-    {
-      transparency[0] = '0';
-      transparency[1] = '0';
-      transparency[2] = '0';
-    }
-    img[insert_point] = transparency[0];
-    insert_point++;
-    img[insert_point] = transparency[1];
-    insert_point++;
-    img[insert_point] = transparency[2];
-    insert_point++;
+/// yanks the selection or the pixel under the cursor
+static int command_yank(int arg, int count) {
+  int row = cursor_image_row();
+  int col = cursor_image_col();
+  int from_row = row;
+  int from_col = col;
+  if (selected_row != -1 && selected_col != -1) {
+    from_row = selected_row;
+    from_col = selected_col;
+    selected_row = -1;
+    selected_col = -1;
   }
-  
-  FILE *f = fopen("saved_image.pcli_failsave", "w");
-
-  char *wstr = malloc(16);
-  char *hstr = malloc(16);
-  int wstr_len = sprintf(wstr, "%d\n", (image_width / 2));
-  int hstr_len = sprintf(hstr, "%d\n", image_height);
-
-  fwrite(wstr, sizeof(char), wstr_len, f);
-  fwrite(hstr, sizeof(char), hstr_len, f);
-  fwrite(
-    img, 
-    sizeof(char), 
-    3 * IMAGE_DEPTH * (image_width / 2) * image_height, 
-    f
-  );
+  if (yank(from_row, from_col, row, col) == SUCCESS) {
+    set_status("yanked %dx%d", clipboard.width, clipboard.height);
+  }
+  render_frame();
+  return SUCCESS;
+}
 
-  fclose(f);
-  free(img);
+static int command_paste(int arg, int count) {
+  if (!clipboard.pixels) {
+    set_status("nothing yanked");
+    render_frame();
+    return SUCCESS;
+  }
+  paste(cursor_image_row(), cursor_image_col());
   return SUCCESS;
 }
 
-char poll_input() {
-  int nread;
-  char c;
-  if ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-    if (nread == -1 && errno != EAGAIN) {
-      die("read");
-    }
+/// the first move picks up the selection, 
+/// the next one puts it down at the cursor
+static int command_move(int arg, int count) {
+  if (pending_move.from_row != -1) {
+    move_selection(pending_move.from_row, pending_move.from_col, 
+        pending_move.to_row, pending_move.to_col, 
+        cursor_image_row(), cursor_image_col());
+    pending_move.from_row = -1;
+    return SUCCESS;
   }
-  return c;
+  if (selected_row == -1 || selected_col == -1) {
+    set_status("nothing selected");
+  }
+  else {
+    pending_move.from_row = selected_row;
+    pending_move.from_col = selected_col;
+    pending_move.to_row = cursor_image_row();
+    pending_move.to_col = cursor_image_col();
+    selected_row = -1;
+    selected_col = -1;
+    set_status("moving, m again puts it down");
+  }
+  render_frame();
+  return SUCCESS;
 }
 
-void log_image() {
-  FILE *f = fopen("log.txt", "w");
-  fprintf(f, "%s", image);
-  die("\nlog done");
+/// arg is 1 for a horizontal flip, 0 for a vertical one
+static int command_flip(int arg, int count) {
+  flip_clipboard(arg);
+  return SUCCESS;
 }
 
-int get_command_inx(char c) {
-  for (int i = 0; i < COMMANDC; i++) {
-    if (commands[i][1][0] == c) {
-      return i;
-    }
+static int command_rotate(int arg, int count) {
+  for (int i = 0; i < count % 4; i++) {
+    rotate_clipboard();
   }
-  return -1;
+  return SUCCESS;
 }
 
-int handle_input(char c) {
-  int row;
-  int col;
-  // get current cursor position
-  if (get_cursor_pos(&row, &col) == -1) {
-    die("get_cursor_pos");
-    return ERROR;
+/// arg is the direction (1 next, -1 previous)
+static int command_buffer(int arg, int count) {
+  int inx = ((current_buffer + arg * count) % bufferc + bufferc) % bufferc;
+  const char *name = buffers[inx].path[0] ? buffers[inx].path : "new image";
+  if (switch_buffer(inx) == ERROR) {
+    if (current_buffer != inx) {
+      set_status("couldn't load %s", name);
+    }
+    else {
+      set_status("couldn't restore all of %s", name);
+    }
+  }
+  else {
+    set_status("[%d/%d] %s", inx + 1, bufferc, name);
   }
+  clamp_offsets();
+  clear_screen();
+  print_screen();
+  return SUCCESS;
+}
 
-  int inx = get_command_inx(c);
+// the special keys and batch scripts refer to the commands by their
+// CMD_* index, counted commands use the count typed in front of them
+struct command commands[COMMANDC] = {
+  [CMD_QUIT] = {"quit", "q", command_quit, 0, 0},
+  [CMD_MOVE_LEFT] = {"move_left", "h", command_move_left, 0, 1},
+  [CMD_MOVE_DOWN] = {"move_down", "j", command_move_down, 0, 1},
+  [CMD_MOVE_UP] = {"move_up", "k", command_move_up, 0, 1},
+  [CMD_MOVE_RIGHT] = {"move_right", "l", command_move_right, 0, 1},
+  [CMD_OFFSET_LEFT] = {"offset_left", "H", command_offset_left, 0, 1},
+  [CMD_OFFSET_DOWN] = {"offset_down", "J", command_offset_down, 0, 1},
+  [CMD_OFFSET_UP] = {"offset_up", "K", command_offset_up, 0, 1},
+  [CMD_OFFSET_RIGHT] = {"offset_right", "L", command_offset_right, 0, 1},
+  [CMD_MOVE_TOP] = {"move_top", "g", command_move_top, 0, 0},
+  [CMD_MOVE_BOTTOM] = {"move_bottom", "G", command_move_bottom, 0, 0},
+  [CMD_FILL] = {"fill", "f", command_fill, 0, 0},
+  [CMD_DELETE] = {"delete", "d", command_delete, 0, 0},
+  [CMD_SELECT] = {"select", "v", command_select, 0, 0},
+  [CMD_JUMP_FORWARD] = {"jump_forward", "w", command_jump, 1, 1},
+  [CMD_JUMP_BACKWARD] = {"jump_backward", "b", command_jump, -1, 1},
+  [CMD_COLOR_0] = {"color_0", "0", command_color, 0, 0},
+  [CMD_COLOR_1] = {"color_1", "1", command_color, 1, 0},
+  [CMD_COLOR_2] = {"color_2", "2", command_color, 2, 0},
+  [CMD_COLOR_3] = {"color_3", "3", command_color, 3, 0},
+  [CMD_COLOR_4] = {"color_4", "4", command_color, 4, 0},
+  [CMD_COLOR_5] = {"color_5", "5", command_color, 5, 0},
+  [CMD_COLOR_6] = {"color_6", "6", command_color, 6, 0},
+  [CMD_COLOR_7] = {"color_7", "7", command_color, 7, 0},
+  [CMD_COLOR_8] = {"color_8", "8", command_color, 8, 0},
+  [CMD_COLOR_9] = {"color_9", "9", command_color, 9, 0},
+  [CMD_SAVE] = {"save", "s", command_save, 0, 0},
+  [CMD_RELOAD] = {"reload", "r", command_reload, 0, 0},
+  [CMD_PIPETTE] = {"pipette", "i", command_pipette, 0, 0},
+  [CMD_PIPETTE_SAVE] = {"pipette_save", "I", command_pipette_save, 0, 0},
+  [CMD_BUCKET_FILL] = {"bucket_fill", "F", command_bucket_fill, 0, 0},
+  [CMD_UNDO] = {"undo", "u", command_undo, 0, 1},
+  [CMD_REDO] = {"redo", "U", command_redo, 0, 1},
+  [CMD_SAVE_FAST] = {"save_fast", "S", command_save_fast, 0, 0},
+  [CMD_ZOOM_IN] = {"zoom_in", "+", command_zoom_in, 0, 1},
+  [CMD_ZOOM_OUT] = {"zoom_out", "-", command_zoom_out, 0, 1},
+  [CMD_HALF_BLOCK] = {"half_block", "B", command_half_block, 0, 0},
+  [CMD_LAYER_ADD] = {"layer_add", "A", command_layer_add, 0, 0},
+  [CMD_LAYER_DELETE] = {"layer_delete", "X", command_layer_delete, 0, 0},
+  [CMD_LAYER_UP] = {"layer_up", "]", command_layer_select, 1, 1},
+  [CMD_LAYER_DOWN] = {"layer_down", "[", command_layer_select, -1, 1},
+  [CMD_LAYER_VISIBLE] = {"layer_visible", "V", command_layer_visible, 0, 0},
+  [CMD_LAYER_OPACITY_UP] = 
+    {"layer_opacity_up", "}", command_layer_opacity, 1, 1},
+  [CMD_LAYER_OPACITY_DOWN] = 
+    {"layer_opacity_down", "{", command_layer_opacity, -1, 1},
+  [CMD_LAYER_BLEND] = {"layer_blend", "M", command_layer_blend, 0, 0},
+  [CMD_INDEXED] = {"indexed", "P", command_indexed, 0, 0},
+  [CMD_RECOLOR] = {"recolor", "R", command_recolor, 0, 0},
+  [CMD_YANK] = {"yank", "y", command_yank, 0, 0},
+  [CMD_PASTE] = {"paste", "p", command_paste, 0, 0},
+  [CMD_MOVE] = {"move", "m", command_move, 0, 0},
+  [CMD_FLIP_HORIZONTAL] = {"flip_horizontal", "o", command_flip, 1, 0},
+  [CMD_FLIP_VERTICAL] = {"flip_vertical", "O", command_flip, 0, 0},
+  [CMD_ROTATE] = {"rotate", "t", command_rotate, 0, 1},
+  [CMD_BUFFER_NEXT] = {"buffer_next", "n", command_buffer, 1, 1},
+  [CMD_BUFFER_PREVIOUS] = {"buffer_previous", "N", command_buffer, -1, 1}
+};
 
-  switch (inx) {
-    case 0: // quit
-      return 1;
-    case 1: // move_left
-      write(STDIN_FILENO, "\x1b[2D", 4);
-      break;
-    case 2: // move_down
-      write(STDIN_FILENO, "\x1b[B", 3);
-      break;
-    case 3: // move_up
-      write(STDIN_FILENO, "\x1b[A", 3);
-      break;
-    case 4: // move_right
-      if (col > term.cols - 3) { break; } // don't allow move 
-                        // to single last col
-      write(STDIN_FILENO, "\x1b[2C", 4);
-      break;
-    case 5: // offset_left
-      if (x_offset > 1) {
-        x_offset -= 2;
+/// runs the command with the given index count times 
+/// (commands which can't be repeated ignore the count)
+///
+/// returns 1 if the editor should quit
+int run_command(int inx, int count) {
+  if (inx < 0 || inx >= COMMANDC) {
+    return SUCCESS;
+  }
+  return commands[inx].run(commands[inx].arg, count);
+}
 
-        // save cursor pos
-        write(STDOUT_FILENO, "\x1b[s", 3);
+/// adds a node to the key trie and returns its index
+static int add_key_node() {
+  if (key_nodec == key_node_cap) {
+    key_node_cap = MAX(key_node_cap * 2, 64);
+    key_nodes = realloc(key_nodes, key_node_cap * sizeof(*key_nodes));
+    if (!key_nodes) {
+      die("realloc");
+    }
+  }
+  key_nodes[key_nodec].inx = -1;
+  key_nodes[key_nodec].next = NULL;
+  return key_nodec++;
+}
 
-        print_screen();
+/// builds the key trie from the bindings of the commands, 
+/// call it again after changing them
+///
+/// a key bound to more than one command runs the first of them
+void build_key_table() {
+  for (int i = 0; i < key_nodec; i++) {
+    free(key_nodes[i].next);
+  }
+  key_nodec = 0;
+  add_key_node(); // the root
 
-        // restore cursor pos
-        write(STDOUT_FILENO, "\x1b[u", 3);
+  for (int i = 0; i < COMMANDC; i++) {
+    int node = 0;
+    for (const char *k = commands[i].keys; *k; k++) {
+      if (!key_nodes[node].next) {
+        key_nodes[node].next = calloc(KEY_TABLE_SIZE, sizeof(int));
+        if (!key_nodes[node].next) {
+          die("calloc");
+        }
       }
-      break;
-    case 6: // offset_down
-      if (image_height - y_offset > term.rows) {
-        y_offset += 1;
-
-        // save cursor pos
-        write(STDOUT_FILENO, "\x1b[s", 3);
+      int next = key_nodes[node].next[(unsigned char)*k];
+      if (next == 0) {
+        // add_key_node can move the nodes
+        next = add_key_node();
+        key_nodes[node].next[(unsigned char)*k] = next;
+      }
+      node = next;
+    }
+    if (node != 0 && key_nodes[node].inx == -1) {
+      key_nodes[node].inx = i;
+    }
+  }
+}
 
-        print_screen();
+/// returns the node the key leads to from the given node or 0
+static inline int next_key_node(int node, int key) {
+  return key_nodes[node].next ? key_nodes[node].next[key] : 0;
+}
 
-        // restore cursor pos
-        write(STDOUT_FILENO, "\x1b[u", 3);
-      }
-      break;
-    case 7: // offset_up
-      if (y_offset > 0) {
-        y_offset -= 1;
+/// handles the last mouse event: a click paints the pixel under it,
+/// dragging selects from where the button was pressed to where it
+/// is released (fill or delete it afterwards) and the wheel scrolls
+void handle_mouse() {
+  // set while the left button is held on the image
+  static int held = 0;
+  static int dragged = 0;
+  static int press_row;
+  static int press_col;
+
+  if (mouse.button >= MOUSE_WHEEL) {
+    if (mouse.pressed) {
+      int inx = mouse.button == MOUSE_WHEEL ? CMD_OFFSET_UP : CMD_OFFSET_DOWN;
+      run_command(inx, WHEEL_STEPS);
+    }
+    return;
+  }
+  if (mouse.button != 0) {
+    return;
+  }
 
-        // save cursor pos
-        write(STDOUT_FILENO, "\x1b[s", 3);
+  // the cell under the mouse, only cells showing the image count
+  int cell_row = mouse.line * cells_per_line();
+  int cell_col = mouse.col / chars_per_cell();
+  int inside = mouse.line < term.lines 
+    && cell_row < MIN(term.rows, view_rows()) 
+    && cell_col < MIN(term.cols, view_cols());
 
-        print_screen();
+  if (mouse.pressed && !mouse.motion) {
+    if (!inside) {
+      return;
+    }
+    y_cursor = cell_row;
+    x_cursor = cell_col;
+    clamp_cursor();
+    held = 1;
+    dragged = 0;
+    press_row = cursor_image_row();
+    press_col = cursor_image_col();
+    render_frame();
+    return;
+  }
+  if (!held) {
+    return;
+  }
 
-        // restore cursor pos
-        write(STDOUT_FILENO, "\x1b[u", 3);
-      }
-      break;
-    case 8: // offset_right
-      if (image_width - x_offset > term.cols + 1) {
-        x_offset += 2;
+  if (mouse.motion) {
+    if (!inside) {
+      return;
+    }
+    y_cursor = cell_row;
+    x_cursor = cell_col;
+    clamp_cursor();
+    if (!dragged && (cursor_image_row() != press_row 
+          || cursor_image_col() != press_col)) 
+    {
+      dragged = 1;
+      selected_row = press_row;
+      selected_col = press_col;
+    }
+    render_frame();
+    return;
+  }
 
-        // save cursor pos
-        write(STDOUT_FILENO, "\x1b[s", 3);
+  // released
+  held = 0;
+  if (!dragged) {
+    fill_pixel(press_row, press_col, r_sel, g_sel, b_sel, a_sel);
+  }
+}
 
-        print_screen();
+/// handles a decoded key
+///
+/// digits in front of a command are its count (10l, 5J), they still
+/// select their color right away but if they turn out to be a count 
+/// the color from before them is restored
+///
+/// keys bound to chords (gg) wait for the rest of the chord, a key
+/// which doesn't continue it runs what the chord got to and is then
+/// handled on its own, escape drops the chord
+///
+/// returns 1 if the editor should quit
+int handle_key(int key) {
+  static int count = 0;
+  static int color_before[4];
+  static int chord = 0; // node of the keys of the chord typed so far
+
+  if (chord == 0 && key >= '0' && key <= '9' && (count > 0 || key != '0')) {
+    if (count == 0) {
+      color_before[0] = r_sel;
+      color_before[1] = g_sel;
+      color_before[2] = b_sel;
+      color_before[3] = a_sel;
+    }
+    count = MIN(count * 10 + key - '0', COUNT_MAX);
+    return run_command(key_nodes[next_key_node(0, key)].inx, 1);
+  }
+  if (chord != 0 && key == '\x1b') {
+    chord = 0;
+    count = 0;
+    return SUCCESS;
+  }
 
-        // restore cursor pos
-        write(STDOUT_FILENO, "\x1b[u", 3);
-      }
-      break;
-    case 9: // move_top
-      write(STDOUT_FILENO, "\x1b[H", 3);
-      break;
-    case 10: // move_bottom
-      write(STDOUT_FILENO, "\x1b[999B", 6);
-      break;
-    case 11: // fill
-      if (selected_row != -1 && selected_col != -1) {
-        fill_selection(selected_row, selected_col, 
-          row + y_offset, col + x_offset, 
-          r_sel, g_sel, b_sel
-        );
-        selected_row = -1;
-        selected_col = -1;
-        break;
-      }
-      fill_pixel(row + y_offset, col + x_offset, 
-          r_sel, g_sel, b_sel
-        );
-      break;
-    case 12: // delete
-      if (selected_row != -1 && selected_col != -1) {
-        fill_selection(selected_row, selected_col, 
-          row + y_offset, col + x_offset, 
-          transparency_color[0], 
-          transparency_color[1], 
-          transparency_color[2]);
-        selected_row = -1;
-        selected_col = -1;
-        break;
-      }
-      fill_pixel(row + y_offset, col + x_offset, 
-        transparency_color[0], 
-        transparency_color[1], 
-        transparency_color[2]);
-      break;
-    case 13: // select
-      if (selected_row != -1 && selected_col != -1) {
-        selected_row = -1;
-        selected_col = -1;
-        break;
-      }
-      selected_row = row + y_offset;
-      selected_col = col + x_offset;
-      break;
-    case 14: // jump_forward
-      jmp_next_color(row, col, 1);
-      break;
-    case 15: // jump_backward
-      jmp_next_color(row, col, -1);
-      break;
-    case 16: // color 0
-      r_sel = color_palette[0][0];
-      g_sel = color_palette[0][1];
-      b_sel = color_palette[0][2];
-      break;
-    case 17: // color 1
-      r_sel = color_palette[1][0];
-      g_sel = color_palette[1][1];
-      b_sel = color_palette[1][2];
-      break;
-    case 18: // color 2
-      r_sel = color_palette[2][0];
-      g_sel = color_palette[2][1];
-      b_sel = color_palette[2][2];
-      break;
-    case 19: // color 3
-      r_sel = color_palette[3][0];
-      g_sel = color_palette[3][1];
-      b_sel = color_palette[3][2];
-      break;
-    case 20: // color 4
-      r_sel = color_palette[4][0];
-      g_sel = color_palette[4][1];
-      b_sel = color_palette[4][2];
-      break;
-    case 21: // color 5
-      r_sel = color_palette[5][0];
-      g_sel = color_palette[5][1];
-      b_sel = color_palette[5][2];
-      break;
-    case 22: // color 6
-      r_sel = color_palette[6][0];
-      g_sel = color_palette[6][1];
-      b_sel = color_palette[6][2];
-      break;
-    case 23: // color 7
-      r_sel = color_palette[7][0];
-      g_sel = color_palette[7][1];
-      b_sel = color_palette[7][2];
-      break;
-    case 24: // color 8
-      r_sel = color_palette[8][0];
-      g_sel = color_palette[8][1];
-      b_sel = color_palette[8][2];
-      break;
-    case 25: // color 9
-      r_sel = color_palette[9][0];
-      g_sel = color_palette[9][1];
-      b_sel = color_palette[9][2];
-      break;
-    case 26: // save
-      if (1 || save_image() == ERROR) {
-        save_image_fallback();
-        perror("Error on save! Resorted to fallback method.");
-        return ERROR;
-      }
-      break;
-    case 27: // reload
-      // BUG: doesn't do anything for some reason
-      set_terminal_size(); // recalc terminal size
-      clear_screen();
-      print_screen();
-    case 28: // pipette
-      pipette(row + y_offset, col + x_offset);
+  int inx = -1;
+  int n = MAX(count, 1);
+  int replay = -1; // a key which ended a chord and is handled again
+  if (key < KEY_NONE) {
+    int next = next_key_node(chord, key);
+    if (next == 0 && chord != 0) {
+      inx = key_nodes[chord].inx;
+      replay = key;
+    }
+    else if (next != 0 && key_nodes[next].next) {
+      chord = next;
+      return SUCCESS;
+    }
+    else {
+      // node 0 is the root, which no command is bound to
+      inx = key_nodes[next].inx;
+    }
+  }
+  chord = 0;
+
+  switch (key) {
+    case KEY_MOUSE:
+      count = 0;
+      handle_mouse();
+      return SUCCESS;
+    case KEY_LEFT: inx = CMD_MOVE_LEFT; break;
+    case KEY_DOWN: inx = CMD_MOVE_DOWN; break;
+    case KEY_UP: inx = CMD_MOVE_UP; break;
+    case KEY_RIGHT: inx = CMD_MOVE_RIGHT; break;
+    case KEY_HOME: inx = CMD_MOVE_TOP; break;
+    case KEY_END: inx = CMD_MOVE_BOTTOM; break;
+    case KEY_DELETE: inx = CMD_DELETE; break;
+    case KEY_PAGE_DOWN: // offset by a screen
+      inx = CMD_OFFSET_DOWN;
+      n *= term.rows;
       break;
-    case 29: // pipette_save
-      pipette(row + y_offset, col + x_offset);
-      save_pipette_color(poll_input());
+    case KEY_PAGE_UP: // offset by a screen
+      inx = CMD_OFFSET_UP;
+      n *= term.rows;
       break;
     default:
       break;
   }
-  return SUCCESS;
+
+  if (count > 0 && inx != -1 && commands[inx].counted) {
+    r_sel = color_before[0];
+    g_sel = color_before[1];
+    b_sel = color_before[2];
+    a_sel = color_before[3];
+  }
+  count = 0;
+  if (run_command(inx, n) == 1) {
+    return 1;
+  }
+  return replay != -1 ? handle_key(replay) : SUCCESS;
 }
 
-void rebind_command(char *command, char c) {
+/// binds the keys to the command, the key table has to be built again
+/// afterwards
+void rebind_command(const char *command, const char *keys) {
   for (int i = 0; i < COMMANDC; i++) {
-    if (strcmp(command, commands[i][0]) != 0) {
+    if (strcmp(command, commands[i].name) != 0) {
       continue;
     }
 
-    char *key = malloc(2);
-    key[0] = c;
-    key[1] = '\0';
-    commands[i][1] = key;
-
+    snprintf(commands[i].keys, sizeof(commands[i].keys), "%s", keys);
     return;
   }
 }
 
+/// turns the name of a png filter (none, sub, up, avg, paeth, all) 
+/// into the filter mask, anything else leaves the choice to libpng
+int parse_png_filter(const char *name) {
+  if (strcmp(name, "none") == 0) { return PNG_FILTER_NONE; }
+  if (strcmp(name, "sub") == 0) { return PNG_FILTER_SUB; }
+  if (strcmp(name, "up") == 0) { return PNG_FILTER_UP; }
+  if (strcmp(name, "avg") == 0) { return PNG_FILTER_AVG; }
+  if (strcmp(name, "paeth") == 0) { return PNG_FILTER_PAETH; }
+  if (strcmp(name, "all") == 0) { return PNG_ALL_FILTERS; }
+  return PNG_FILTER_DEFAULT_MASK;
+}
+
 void process_config_line(char *line) {
   int inx;
   int r;
@@ -1168,15 +5679,157 @@ void process_config_line(char *line) {
     transparency_color[0] = r;
     transparency_color[1] = g;
     transparency_color[2] = b;
+    // missing tiles read as the new transparency color
+    if (empty_tile) {
+      update_empty_tile();
+    }
+    return;
+  }
+
+  int is_checker_color_setting = sscanf(
+      line, "checker_color = %x;%x;%x", &r, &g, &b
+    );
+
+  if (is_checker_color_setting != EOF
+    && is_checker_color_setting != no_result)
+  {
+    checker_color[0] = r;
+    checker_color[1] = g;
+    checker_color[2] = b;
+    return;
+  }
+
+  int value;
+  int is_connectivity_setting = sscanf(
+      line, "bucket_fill_connectivity = %d", &value
+    );
+
+  if (is_connectivity_setting != EOF 
+    && is_connectivity_setting != no_result)
+  {
+    fill_connectivity = value == 8 ? 8 : 4;
+    return;
+  }
+
+  int is_history_setting = sscanf(line, "history_memory = %d", &value);
+
+  if (is_history_setting != EOF && is_history_setting != no_result) {
+    // given in megabytes
+    history_budget = (size_t)MAX(value, 0) * 1024 * 1024;
+    return;
+  }
+
+  int is_buffer_setting = sscanf(line, "buffer_memory = %d", &value);
+
+  if (is_buffer_setting != EOF && is_buffer_setting != no_result) {
+    // given in megabytes
+    buffer_budget = (size_t)MAX(value, 0) * 1024 * 1024;
+    return;
+  }
+
+  int is_compression_setting = sscanf(
+      line, "snapshot_compression = %d", &value
+    );
+
+  if (is_compression_setting != EOF 
+    && is_compression_setting != no_result) 
+  {
+    snapshot_compression = value != 0;
+    return;
+  }
+
+  int is_tolerance_setting = sscanf(
+      line, "bucket_fill_tolerance = %d", &value
+    );
+
+  if (is_tolerance_setting != EOF && is_tolerance_setting != no_result) {
+    fill_tolerance = MAX(value, 0);
+    return;
+  }
+
+  int is_png_compression_setting = sscanf(
+      line, "png_compression = %d", &value
+    );
+
+  if (is_png_compression_setting != EOF 
+    && is_png_compression_setting != no_result) 
+  {
+    png_settings.compression = MIN(MAX(value, -1), 9);
+    return;
+  }
+
+  int is_png_threads_setting = sscanf(line, "png_threads = %d", &value);
+
+  if (is_png_threads_setting != EOF && is_png_threads_setting != no_result) {
+    // 0 means one thread per core
+    png_settings.threads = MAX(value, 0);
+    return;
+  }
+
+  int is_mouse_setting = sscanf(line, "mouse = %d", &value);
+
+  if (is_mouse_setting != EOF && is_mouse_setting != no_result) {
+    mouse_reporting = value != 0;
+    return;
+  }
+
+  int is_simd_setting = sscanf(line, "simd = %d", &value);
+
+  if (is_simd_setting != EOF && is_simd_setting != no_result) {
+    // 0 forces the scalar kernels
+    if (value == 0) {
+      kernels = &scalar_kernels;
+    }
+    return;
+  }
+
+  int is_short_escapes_setting = sscanf(
+      line, "short_escapes = %d", &value
+    );
+
+  if (is_short_escapes_setting != EOF 
+    && is_short_escapes_setting != no_result) 
+  {
+    short_escapes = value != 0;
+    return;
+  }
+
+  int is_paste_setting = sscanf(line, "paste_transparent = %d", &value);
+
+  if (is_paste_setting != EOF && is_paste_setting != no_result) {
+    paste_skip_transparent = value == 0;
+    return;
+  }
+
+  int is_half_block_setting = sscanf(line, "half_block = %d", &value);
+
+  if (is_half_block_setting != EOF && is_half_block_setting != no_result) {
+    half_block = value != 0;
+    return;
+  }
+
+  char name[PATH_MAX];
+  int is_png_filter_setting = sscanf(line, "png_filter = %15s", name);
+
+  if (is_png_filter_setting != EOF && is_png_filter_setting != no_result) {
+    png_settings.filters = parse_png_filter(name);
+    return;
+  }
+
+  int is_save_path_setting = sscanf(line, "save_path = %4095[^\n]", name);
+
+  if (is_save_path_setting != EOF && is_save_path_setting != no_result) {
+    strcpy(save_path, name);
+    save_path_set = 1;
     return;
   }
 
   char command[20];
-  char c;
-  int is_command_rebind = sscanf(line, "bind %s %c", command, &c);
+  char keys[BINDING_MAX];
+  int is_command_rebind = sscanf(line, "bind %19s %15s", command, keys);
 
-  if (is_command_rebind != EOF && is_command_rebind != no_result) {
-    rebind_command(command, c);
+  if (is_command_rebind == 2) {
+    rebind_command(command, keys);
     return;
   }
 }
@@ -1224,15 +5877,421 @@ int load_config() {
   return SUCCESS;
 }
 
+/*** batch ***/
+
+/// returns the index of the command with the given name or -1
+int get_command_inx_by_name(const char *name) {
+  for (int i = 0; i < COMMANDC; i++) {
+    if (strcmp(name, commands[i].name) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/// parses a batch script, one command per line:
+///
+///   color_N                       select a palette color
+///   pipette ROW COL               select the color of a pixel
+///   select ROW COL                start a selection
+///   fill ROW COL [ROW2 COL2]      fill a pixel (or the selection)
+///   delete ROW COL [ROW2 COL2]    same as fill with the transparency
+///   bucket_fill ROW COL
+///   undo, redo
+///   indexed                       convert to or from a palette image
+///   recolor ROW COL               set the palette entry of a pixel
+///                                 to the selected color
+///   yank ROW COL ROW2 COL2        copy a rectangle to the clipboard
+///   paste ROW COL                 paste the clipboard there
+///   move ROW COL ROW2 COL2 ROW3 COL3
+///                                 move a rectangle to ROW3 COL3
+///   flip_horizontal, flip_vertical, rotate   change the clipboard
+///   save [PATH], save_fast [PATH] {} in PATH is the input file name,
+///                                 without a PATH it is the input file
+///                                 with _out.png as extension
+///
+/// empty lines and lines starting with # are ignored
+int parse_batch_script(const char *path, struct batch_cmd **cmds, int *cmdc) {
+  *cmds = NULL;
+  *cmdc = 0;
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    fprintf(stderr, "Couldn't open the script %s!\n", path);
+    return ERROR;
+  }
+
+  int cap = 0;
+  char *line = NULL;
+  size_t len = 0;
+  int line_nr = 0;
+  int result = SUCCESS;
+
+  while (getline(&line, &len, f) != EOF) {
+    line_nr++;
+    char name[32];
+    int consumed = 0;
+    if (sscanf(line, " %31s%n", name, &consumed) != 1 || name[0] == '#') {
+      continue;
+    }
+
+    if (*cmdc == cap) {
+      cap = MAX(cap * 2, 16);
+      *cmds = realloc(*cmds, cap * sizeof(**cmds));
+      if (!*cmds) {
+        die("realloc");
+      }
+    }
+    struct batch_cmd *cmd = &(*cmds)[*cmdc];
+    memset(cmd, 0, sizeof(*cmd));
+    cmd->line = line_nr;
+    cmd->inx = get_command_inx_by_name(name);
+
+    char *rest = line + consumed;
+    int needed = -1; // allowed amount of numbers, -1 for none
+    switch (cmd->inx) {
+      case CMD_FILL:
+      case CMD_DELETE:
+        cmd->argc = sscanf(rest, "%d %d %d %d", 
+            &cmd->args[0], &cmd->args[1], &cmd->args[2], &cmd->args[3]);
+        needed = (cmd->argc == 2 || cmd->argc == 4) ? cmd->argc : 2;
+        break;
+      case CMD_SELECT:
+      case CMD_PIPETTE:
+      case CMD_BUCKET_FILL:
+      case CMD_RECOLOR:
+      case CMD_PASTE:
+        cmd->argc = sscanf(rest, "%d %d", &cmd->args[0], &cmd->args[1]);
+        needed = 2;
+        break;
+      case CMD_YANK:
+        cmd->argc = sscanf(rest, "%d %d %d %d", 
+            &cmd->args[0], &cmd->args[1], &cmd->args[2], &cmd->args[3]);
+        needed = 4;
+        break;
+      case CMD_MOVE:
+        cmd->argc = sscanf(rest, "%d %d %d %d %d %d", 
+            &cmd->args[0], &cmd->args[1], &cmd->args[2], &cmd->args[3],
+            &cmd->args[4], &cmd->args[5]);
+        needed = 6;
+        break;
+      case CMD_SAVE:
+      case CMD_SAVE_FAST:
+        if (sscanf(rest, " %4095[^\n]", cmd->path) != 1) {
+          cmd->path[0] = '\0';
+        }
+        break;
+      case CMD_UNDO:
+      case CMD_REDO:
+      case CMD_INDEXED:
+      case CMD_FLIP_HORIZONTAL:
+      case CMD_FLIP_VERTICAL:
+      case CMD_ROTATE:
+        break;
+      default:
+        if (cmd->inx >= CMD_COLOR_0 && cmd->inx <= CMD_COLOR_9) {
+          break;
+        }
+        fprintf(stderr, "%s:%d: unknown batch command %s\n", 
+            path, line_nr, name);
+        result = ERROR;
+        continue;
+    }
+
+    if (needed != -1 && cmd->argc != needed) {
+      fprintf(stderr, "%s:%d: %s needs %d coordinates\n", 
+          path, line_nr, name, needed);
+      result = ERROR;
+      continue;
+    }
+    (*cmdc)++;
+  }
+
+  free(line);
+  fclose(f);
+  return result;
+}
+
+/// builds the output path of a save command for the input file
+static void batch_save_path(const struct batch_cmd *cmd, const char *file, 
+    char *out) 
+{
+  if (cmd->path[0] == '\0') {
+    default_save_path(file, out);
+    return;
+  }
+  expand_save_path(cmd->path, file, out);
+}
+
+/// runs the script on the loaded image
+///
+/// returns the line of the failing command or SUCCESS
+int run_batch_script(const struct batch_cmd *cmds, int cmdc, 
+    const char *file) 
+{
+  for (int i = 0; i < cmdc; i++) {
+    const struct batch_cmd *cmd = &cmds[i];
+    const int *a = cmd->args;
+    char path[PATH_MAX];
+
+    switch (cmd->inx) {
+      case CMD_FILL:
+      case CMD_DELETE: {
+        // delete fills with a transparent color
+        int alpha = cmd->inx == CMD_DELETE ? 0 : a_sel;
+        int r = r_sel;
+        int g = g_sel;
+        int b = b_sel;
+        if (cmd->argc == 4) {
+          fill_selection(a[0], a[1], a[2], a[3], r, g, b, alpha);
+        }
+        else if (selected_row != -1 && selected_col != -1) {
+          fill_selection(selected_row, selected_col, a[0], a[1], 
+              r, g, b, alpha);
+          selected_row = -1;
+          selected_col = -1;
+        }
+        else {
+          fill_pixel(a[0], a[1], r, g, b, alpha);
+        }
+        break;
+      }
+      case CMD_SELECT:
+        selected_row = a[0];
+        selected_col = a[1];
+        break;
+      case CMD_PIPETTE:
+        if (a[0] < 0 || a[1] < 0 
+          || a[0] >= (int)image.height || a[1] >= (int)image.width) 
+        {
+          return cmd->line;
+        }
+        pipette(a[0], a[1]);
+        break;
+      case CMD_BUCKET_FILL:
+        bucket_fill(a[0], a[1], r_sel, g_sel, b_sel, a_sel);
+        break;
+      case CMD_UNDO:
+        undo();
+        break;
+      case CMD_REDO:
+        redo();
+        break;
+      case CMD_INDEXED:
+        if (convert_canvas(active_canvas(), !active_canvas()->palette) 
+            == ERROR) 
+        {
+          return cmd->line;
+        }
+        break;
+      case CMD_RECOLOR:
+        if (recolor_entry(a[0], a[1], r_sel, g_sel, b_sel, a_sel) == ERROR) {
+          return cmd->line;
+        }
+        break;
+      case CMD_YANK:
+        if (yank(a[0], a[1], a[2], a[3]) == ERROR) {
+          return cmd->line;
+        }
+        break;
+      case CMD_PASTE:
+        paste(a[0], a[1]);
+        break;
+      case CMD_MOVE:
+        move_selection(a[0], a[1], a[2], a[3], a[4], a[5]);
+        break;
+      case CMD_FLIP_HORIZONTAL:
+      case CMD_FLIP_VERTICAL:
+        flip_clipboard(cmd->inx == CMD_FLIP_HORIZONTAL);
+        break;
+      case CMD_ROTATE:
+        rotate_clipboard();
+        break;
+      case CMD_SAVE:
+      case CMD_SAVE_FAST:
+        batch_save_path(cmd, file, path);
+        if (save_image(&image, path, 
+              cmd->inx == CMD_SAVE ? &png_settings : &png_fast_settings) 
+            != SUCCESS) 
+        {
+          return cmd->line;
+        }
+        break;
+      default: { // color_N
+        int color = cmd->inx - CMD_COLOR_0;
+        r_sel = color_palette[color][0];
+        g_sel = color_palette[color][1];
+        b_sel = color_palette[color][2];
+        a_sel = 255;
+        break;
+      }
+    }
+  }
+  return SUCCESS;
+}
+
+static double elapsed_ms(const struct timespec *from) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - from->tv_sec) * 1e3 
+    + (now.tv_nsec - from->tv_nsec) / 1e6;
+}
+
+/// processes one file in a worker process and reports
+/// one line with the result and the time it took
+static int batch_worker(const struct batch_cmd *cmds, int cmdc, 
+    const char *file) 
+{
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  char msg[64];
+  int result = ERROR;
+  if (load_image((char *)file) == ERROR) {
+    snprintf(msg, sizeof(msg), "couldn't load");
+  }
+  else {
+    int failed_line = run_batch_script(cmds, cmdc, file);
+    if (failed_line != SUCCESS) {
+      snprintf(msg, sizeof(msg), "failed on line %d", failed_line);
+    }
+    else {
+      snprintf(msg, sizeof(msg), "ok");
+      result = SUCCESS;
+    }
+  }
+
+  // a single write per line so the lines of the workers don't mix
+  char report[PATH_MAX + 128];
+  int len = snprintf(report, sizeof(report), "%s\t%s\t%.3f ms\n", 
+      file, msg, elapsed_ms(&start));
+  write_all(STDOUT_FILENO, report, MIN(len, (int)sizeof(report) - 1));
+  return result;
+}
+
+/// runs a script on all given files without a terminal
+///
+/// usage: pixelcli --batch SCRIPT [-j JOBS] FILE...
+///
+/// the editing state is global, so every file gets its own worker 
+/// process and up to JOBS (default: one per core) run at once
+int run_batch(int argc, char *argv[]) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: pixelcli --batch script [-j jobs] file...\n");
+    return ERROR;
+  }
+  char *script = argv[0];
+  argv++;
+  argc--;
+
+  int jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  if (argc >= 2 && strcmp(argv[0], "-j") == 0) {
+    jobs = atoi(argv[1]);
+    argv += 2;
+    argc -= 2;
+  }
+  jobs = MAX(jobs, 1);
+  if (argc == 0) {
+    fprintf(stderr, "No files given!\n");
+    return ERROR;
+  }
+
+  struct batch_cmd *cmds;
+  int cmdc;
+  if (parse_batch_script(script, &cmds, &cmdc) == ERROR) {
+    free(cmds);
+    return ERROR;
+  }
+
+  batch_mode = 1;
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  int running = 0;
+  int failed = 0;
+  // files from here on aren't started (lowered if fork fails)
+  int last = argc;
+  for (int i = 0; i < last || running > 0; ) {
+    if (i < last && running < jobs) {
+      pid_t pid = fork();
+      if (pid == -1) {
+        perror("fork");
+        failed += last - i;
+        last = i;
+        continue;
+      }
+      if (pid == 0) {
+        _exit(batch_worker(cmds, cmdc, argv[i]) == SUCCESS ? 0 : 1);
+      }
+      running++;
+      i++;
+      continue;
+    }
+
+    int status;
+    if (wait(&status) == -1) {
+      break;
+    }
+    running--;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      failed++;
+    }
+  }
+
+  printf("%d files, %d failed, %.3f ms\n", argc, failed, elapsed_ms(&start));
+  free(cmds);
+  return failed > 0 ? ERROR : SUCCESS;
+}
+
 /*** main ***/
 
 int main(int argc, char *argv[])
 {
-  if (argc > 2) {
-    printf("Usage: pixelcli [filepath]");
+  init_kernels();
+
+  if (argc >= 2 && strcmp(argv[1], "--batch") == 0) {
+    load_config();
+    return run_batch(argc - 2, argv + 2);
+  }
+
+  // -o sets where the image is saved to
+  char *output = NULL;
+  if (argc >= 3 && strcmp(argv[1], "-o") == 0) {
+    output = argv[2];
+    argv += 2;
+    argc -= 2;
+  }
+  if (output && strlen(output) >= PATH_MAX) {
+    printf("Usage: pixelcli [-o output] [filepath...]");
     return ERROR;
   }
-  if (argc == 2) {
+
+  // every file gets a buffer, all but the first one are loaded
+  // when they are switched to
+  bufferc = MAX(argc - 1, 1);
+  buffers = calloc(bufferc, sizeof(*buffers));
+  if (!buffers) {
+    die("calloc");
+  }
+  for (int i = 1; i < argc; i++) {
+    if (strlen(argv[i]) >= PATH_MAX) {
+      printf("Usage: pixelcli [-o output] [filepath...]");
+      return ERROR;
+    }
+    strcpy(buffers[i - 1].path, argv[i]);
+    buffers[i - 1].state = BUFFER_UNLOADED;
+  }
+  buffers[0].state = BUFFER_RESIDENT;
+
+  // before loading, transparent pixels are stored with the
+  // transparency color of the config like the empty tile
+  int cfg_success = load_config();
+  if (cfg_success == ERROR) {
+    fprintf(stderr, "Couldn't load the config file!\
+        \nContinuing with the defaults...\n");
+    fprintf(stderr, "Errno: %d", errno);
+  }
+
+  if (argc >= 2) {
     if (load_image(argv[1]) == ERROR) {
       printf("ERROR: Couldn't load the image!");
       return ERROR;
@@ -1256,31 +6315,35 @@ int main(int argc, char *argv[])
     }
 
     // init image
-    init_image(width, height, NULL, -1);
+    init_image(width, height);
   }
 
-  int cfg_success = load_config();
-  if (cfg_success == ERROR) {
-    fprintf(stderr, "Couldn't load the config file!\
-        \nContinuing with the defaults...\n");
-    fprintf(stderr, "Errno: %d", errno);
+  if (output) {
+    strcpy(save_path, output);
+    save_path_set = 1;
+  }
+  build_key_table();
+
+  if (pipe(event_pipe) == -1) {
+    die("pipe");
   }
+  install_resize_handler();
 
   init_terminal_state();
   clear_screen();
   print_screen();
 
-  // move cursor to beginning of screen
-  write(STDOUT_FILENO, "\x1b[H", 3);
+  // from now on frames are drawn once all pending keys are handled
+  defer_render = 1;
 
   int exit = 0;
   while (exit == 0) {
-    char c = poll_input();
-    if (c == -1) {
-      die("poll_input");
-    }
-    exit = handle_input(c);
+    exit = handle_key(read_key());
   }
 
+  // don't quit in the middle of writing a file
+  finish_save();
+  remove_spilled_buffers();
+
   return SUCCESS;
 }